@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Measure what is saved by not clearing the images that rotate, mirror
+# and crop overwrite anyway, by building a second imageTool with
+# -DCREATE_ALWAYS_CLEAR, with and without the image pool.
+# Usage: ./alloc_bench.sh [FILE.pgm]   (default: a 3840x2160 image;
+#                                       crop takes its top left 1920x1080)
+
+# Define the CSV file name
+CSV_FILE="alloc_results.csv"
+
+# Number of operations per run, and of runs per measurement (the
+# fastest run is kept, to filter out noise from other processes)
+REPS=20
+RUNS=5
+
+make -s imageTool || exit 1
+cc -Wall -O2 -DCREATE_ALWAYS_CLEAR -o imageTool_clear \
+  imageTool.c image8bit.c instrumentation.c error.c -lm || exit 1
+
+if [ $# -ge 1 ]; then
+  input="$1"
+else
+  input="create 3840,2160"
+fi
+
+operations=(
+  "rotate"
+  "mirror"
+  "crop 0,0,1920,1080"
+)
+
+# Run REPS operations RUNS times, with a pool of $3 MB, and print the
+# best time (seconds).  Operations are eager, so that each crop is made
+# by ImageCrop itself.
+run_test() {
+  ops=""
+  for ((i = 0; i < REPS; i++)); do
+    ops="$ops $2"
+  done
+  for ((i = 0; i < RUNS; i++)); do
+    $1 eager pool $3 $input tic $ops toc 2>/dev/null | tail -n 1 |
+      awk '{print $1}'
+  done | sort -g | head -n 1
+}
+
+echo "operation,pool,uninit,clear,speedup" > "$CSV_FILE"
+for op in "${operations[@]}"; do
+  for pool in 0 512; do
+    fast=$(run_test ./imageTool "$op" $pool)
+    slow=$(run_test ./imageTool_clear "$op" $pool)
+    name=${op%% *}
+    speedup=$(awk -v a="$slow" -v b="$fast" 'BEGIN{printf("%.2f", a / b)}')
+    echo "$name,$pool,$fast,$slow,$speedup" >> "$CSV_FILE"
+    echo "$name (pool $pool MB): ${speedup}x"
+  done
+done
+
+rm -f imageTool_clear
+
+# Display a summary message
+echo "All tests have been completed. Results are saved in $CSV_FILE."
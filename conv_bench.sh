@@ -0,0 +1,59 @@
+#!/bin/bash
+
+# Compare the specialised convolution kernels (radius 1, 2, 3) with the
+# generic path, by building a second imageTool with -DCONV_GENERIC_ONLY.
+# Usage: ./conv_bench.sh [FILE.pgm]   (default: a 3840x2160 image)
+
+# Define the CSV file name
+CSV_FILE="conv_results.csv"
+
+# Number of convolutions per run, and of runs per measurement (the
+# fastest run is kept, to filter out noise from other processes)
+REPS=10
+RUNS=5
+
+make -s imageTool || exit 1
+cc -Wall -O2 -DCONV_GENERIC_ONLY -o imageTool_generic \
+  imageTool.c image8bit.c instrumentation.c error.c -lm || exit 1
+
+if [ $# -ge 1 ]; then
+  input="$1"
+else
+  input="create 3840,2160"
+fi
+
+# Binomial kernels of radius 1, 2, 3 (separable), and a 3x3 kernel that
+# is not separable (2D path).
+kernels=(
+  "1 gauss3"
+  "2 gauss5"
+  "3 7,7,4096:1,6,15,20,15,6,1,6,36,90,120,90,36,6,15,90,225,300,225,90,15,20,120,300,400,300,120,20,15,90,225,300,225,90,15,6,36,90,120,90,36,6,1,6,15,20,15,6,1"
+  "1 sharpen"
+)
+
+# Run REPS convolutions RUNS times and print the best time (seconds)
+run_test() {
+  ops=""
+  for ((i = 0; i < REPS; i++)); do
+    ops="$ops conv $2 replicate"
+  done
+  for ((i = 0; i < RUNS; i++)); do
+    $1 $input tic $ops toc 2>/dev/null | tail -n 1 | awk '{print $1}'
+  done | sort -g | head -n 1
+}
+
+echo "radius,kernel,specialised,generic,speedup" > "$CSV_FILE"
+for entry in "${kernels[@]}"; do
+  read -r radius kernel <<< "$entry"
+  fast=$(run_test ./imageTool "$kernel")
+  slow=$(run_test ./imageTool_generic "$kernel")
+  name=${kernel%%:*}
+  speedup=$(awk -v a="$slow" -v b="$fast" 'BEGIN{printf("%.2f", a / b)}')
+  echo "$radius,$name,$fast,$slow,$speedup" >> "$CSV_FILE"
+  echo "radius $radius ($name): ${speedup}x"
+done
+
+rm -f imageTool_generic
+
+# Display a summary message
+echo "All tests have been completed. Results are saved in $CSV_FILE."
@@ -23,9 +23,16 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 // The data structure
 //
@@ -46,12 +53,21 @@
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
 
+// Maximum number of dirty rectangles kept per image
+#define DIRTY_MAX 8
+
 // Internal structure for storing 8-bit graymap images
 struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
   uint8 *pixel; // pixel data (a raster scan)
+  size_t capacity; // bytes allocated for pixel (see the image pool)
+  AllocPolicy alloc; // how pixel was allocated
+  int *refs;         // number of images sharing pixel (see ImageClone)
+  int ndirty;              // number of dirty rectangles
+  int dirty[DIRTY_MAX][4]; // their corners: x0, y0, x1, y1 (exclusive)
+  Image next;      // next image in a pool free list
 };
 
 // This module follows "design-by-contract" principles.
@@ -146,12 +162,16 @@ void ImageInit(void) { ///
   // Name other counters here...
   InstrName[1] = "blur_its";
   InstrName[2] = "ilsi_its";
+  InstrName[3] = "median_its";
+  InstrName[4] = "conv_its";
 }
 
 // Macros to simplify accessing instrumentation counters:
 #define PIXMEM InstrCount[0]
 #define BLUR_ITS InstrCount[1]
 #define ILSI_ITS InstrCount[2]
+#define MEDIAN_ITS InstrCount[3]
+#define CONV_ITS InstrCount[4]
 
 // Add more macros here...
 
@@ -159,6 +179,195 @@ void ImageInit(void) { ///
 
 /// Image management functions
 
+// Huge pages
+//
+// Large pixel buffers may be mapped on 2 MB pages, which cover them with
+// far fewer TLB entries: either transparent huge pages (a mapping aligned
+// on 2 MB, advised with MADV_HUGEPAGE), or explicit ones (MAP_HUGETLB, from
+// the pages reserved by the system administrator).  If explicit pages are
+// not available, transparent ones are used instead; if mapping fails,
+// malloc is.  Buffers smaller than a huge page always come from malloc.
+
+#define HUGE_PAGE ((size_t)2 << 20)
+
+static AllocPolicy allocPolicy = ALLOC_MALLOC; // for new images
+
+// Length of the mapping for a buffer of cap bytes (whole huge pages).
+static size_t hugeLength(size_t cap) {
+  return (cap + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+}
+
+// Allocate a buffer of cap bytes, zeroed if clear, following policy.
+// Sets (*kind) to the policy actually followed.
+// Mappings are always zeroed (by the kernel, on first touch).
+// A failed attempt that is recovered from leaves errno as it was.
+static uint8 *allocPixels(size_t cap, int clear, AllocPolicy policy,
+                          AllocPolicy *kind) {
+#ifdef __linux__
+  if (policy != ALLOC_MALLOC && cap >= HUGE_PAGE) {
+    errsave = errno;
+    size_t len = hugeLength(cap);
+    uint8 *p;
+#ifdef MAP_HUGETLB
+    if (policy == ALLOC_HUGETLB) {
+      p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED) {
+        *kind = ALLOC_HUGETLB;
+        return p;
+      }
+    }
+#endif
+    // Map one more huge page, then unmap the ends, to align on 2 MB.
+    p = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED) {
+      size_t head = (HUGE_PAGE - (uintptr_t)p % HUGE_PAGE) % HUGE_PAGE;
+      if (head > 0)
+        munmap(p, head);
+      munmap(p + head + len, HUGE_PAGE - head);
+#ifdef MADV_HUGEPAGE
+      madvise(p + head, len, MADV_HUGEPAGE); // fails if THP is disabled
+#endif
+      errno = errsave;
+      *kind = ALLOC_THP;
+      return p + head;
+    }
+    errno = errsave;
+  }
+#endif
+  *kind = ALLOC_MALLOC;
+  return clear ? calloc(cap, sizeof(uint8)) : malloc(cap);
+}
+
+// Free the pixel buffer of img, as allocated by allocPixels.
+static void freePixels(Image img) {
+#ifdef __linux__
+  if (img->alloc != ALLOC_MALLOC) {
+    munmap(img->pixel, hugeLength(img->capacity));
+    return;
+  }
+#endif
+  free(img->pixel);
+}
+
+// The image pool
+//
+// Destroyed images may be kept, with their pixel buffers, in free lists by
+// size class, and handed out again by later creations of a similar size.
+// This spares the system allocator, which would otherwise map, fault in and
+// unmap large buffers over and over.  Size classes grow geometrically, with
+// 4 classes per power of two, so a buffer is at most 25% larger than needed.
+// Recycled buffers hold stale pixels: they are cleared only when the new
+// image must start black.  Likewise, new buffers are only zeroed (by calloc)
+// when they must be.
+// Pooling is off until ImagePoolSetLimit is called with a nonzero limit.
+
+// Smallest class, and number of classes
+#define POOL_MINLOG 6
+#define POOL_CLASSES 256
+
+static Image poolFree[POOL_CLASSES]; // free lists, by size class
+static size_t poolLimit = 0;         // max bytes kept in free lists
+static size_t poolCached = 0;        // bytes kept in free lists
+static size_t poolLive = 0;          // bytes in live images
+static size_t poolPeak = 0;          // max of poolLive + poolCached
+static uint64_t poolRequests = 0;    // number of images created
+static uint64_t poolHits = 0;        // ... with a recycled buffer
+
+// Size class for a buffer of size bytes.
+// Sets (*cap) to the capacity of the buffers in that class.
+static int sizeClass(size_t size, size_t *cap) {
+  if (size <= (size_t)1 << POOL_MINLOG) {
+    *cap = (size_t)1 << POOL_MINLOG;
+    return 0;
+  }
+  int e = POOL_MINLOG; // 2^e < size <= 2^(e+1)
+  while (((size_t)1 << (e + 1)) < size)
+    e++;
+  size_t step = (size_t)1 << (e - 2);
+  size_t c = (size + step - 1) / step; // 5..8 steps
+  *cap = c * step;
+  return 4 * (e - POOL_MINLOG) + (int)(c - 4);
+}
+
+// Free the images in the pool until at most limit bytes remain cached.
+static void poolTrim(size_t limit) {
+  for (int c = POOL_CLASSES - 1; c >= 0 && poolCached > limit; c--) {
+    while (poolFree[c] != NULL && poolCached > limit) {
+      Image img = poolFree[c];
+      poolFree[c] = img->next;
+      poolCached -= img->capacity;
+      freePixels(img);
+      free(img);
+    }
+  }
+}
+
+// Create a new image, black if clear, or else with undefined pixels,
+// allocated following policy.
+static Image imageAlloc(int width, int height, uint8 maxval, int clear,
+                        AllocPolicy policy) {
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax);
+#ifdef CREATE_ALWAYS_CLEAR
+  clear = 1; // for comparison (see alloc_bench.sh)
+#endif
+
+  size_t size = (size_t)width * height;
+  size_t cap = size;
+  Image img = NULL;
+  poolRequests++;
+  if (poolLimit > 0) {
+    int c = sizeClass(size, &cap);
+    // Only reuse a buffer on huge pages if asked for one, and vice-versa.
+    int huge = policy != ALLOC_MALLOC && cap >= HUGE_PAGE;
+    if (poolFree[c] != NULL &&
+        (poolFree[c]->alloc != ALLOC_MALLOC) == huge) {
+      img = poolFree[c];
+      poolFree[c] = img->next;
+      poolCached -= img->capacity;
+      poolHits++;
+      if (clear)
+        memset(img->pixel, 0, size);
+    }
+  }
+  if (img == NULL) {
+    img = malloc(sizeof(struct image));
+    if (img == NULL) {
+      errno = ENOMEM;
+      errCause = "Out of memory";
+      return NULL; // in case malloc fails
+    }
+    img->pixel = allocPixels(cap, clear, policy, &img->alloc);
+    if (img->pixel == NULL) {
+      free(img);
+      errno = ENOMEM;
+      errCause = "Out of memory";
+      return NULL;
+    }
+    img->capacity = cap;
+  }
+  img->width = width;
+  img->height = height;
+  img->maxval = maxval;
+  img->next = NULL;
+  img->refs = NULL;
+  img->ndirty = 0;
+
+  poolLive += img->capacity;
+  if (poolLive + poolCached > poolPeak)
+    poolPeak = poolLive + poolCached;
+  return img;
+}
+
+// Same as imageAlloc, following the current policy.
+// Used by ImageCreate, and by operations that overwrite every pixel.
+static Image imageNew(int width, int height, uint8 maxval, int clear) {
+  return imageAlloc(width, height, maxval, clear, allocPolicy);
+}
+
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
@@ -168,26 +377,175 @@ void ImageInit(void) { ///
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) { ///
-  assert(width >= 0);
-  assert(height >= 0);
-  assert(0 < maxval && maxval <= PixMax);
+  return imageNew(width, height, maxval, 1);
+}
 
-  Image img = malloc(sizeof(struct image));
-  if (img == NULL) {
-    errno = ENOMEM;
-    errCause = "Out of memory";
-    return NULL; // in case malloc fails
+/// Create a new image with undefined pixels.
+/// Same as ImageCreate, but the pixels are not cleared, which saves a
+/// pass over the whole buffer.  Meant for clients that set every pixel
+/// before reading any.
+Image ImageCreateUninit(int width, int height, uint8 maxval) { ///
+  return imageNew(width, height, maxval, 0);
+}
+
+// Copy-on-write
+//
+// A clone shares the pixel buffer of its image, along with a count of the
+// images sharing it (refs).  Every operation that changes pixels first
+// calls ownPixels (through willChange), which gives the image a private
+// copy if the buffer is still shared.  So the copy is only made if and when
+// one of the images is changed, and never for images that are only read
+// (by locate, save...).
+
+// Give img a private copy of its pixels, if they are shared.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int unshare(Image img) {
+  if (*img->refs > 1) {
+    AllocPolicy kind;
+    uint8 *p = allocPixels(img->capacity, 0, img->alloc, &kind);
+    if (p == NULL) {
+      errno = ENOMEM;
+      errCause = "Out of memory";
+      return 0;
+    }
+    memcpy(p, img->pixel, (size_t)img->width * img->height);
+    (*img->refs)--;
+    img->pixel = p;
+    img->alloc = kind;
+    poolLive += img->capacity;
+    if (poolLive + poolCached > poolPeak)
+      poolPeak = poolLive + poolCached;
+  } else {
+    free(img->refs);
   }
-  img->width = width;
-  img->height = height;
-  img->maxval = maxval;
+  img->refs = NULL;
+  return 1;
+}
 
-  img->pixel = calloc(width * height, sizeof(uint8));
-  if (img->pixel == NULL) {
-    free(img);
+// Make sure img may be changed: see unshare.
+static inline int ownPixels(Image img) {
+  return img->refs == NULL || unshare(img);
+}
+
+// Dirty rectangles
+//
+// Each image keeps a few rectangles that cover the pixels changed since
+// they were last cleared (by ImageDirtyClear), so that results derived
+// from the image can be brought up to date over those rectangles only.
+// Rectangles that overlap or touch are coalesced into their bounding box;
+// when there are DIRTY_MAX of them already, a new one is merged with the
+// one that it grows the least.
+
+// Add rectangle (x, y, w, h) to the dirty rectangles of img.
+static void markDirty(Image img, int x, int y, int w, int h) {
+  if (w <= 0 || h <= 0)
+    return;
+  int x0 = x, y0 = y, x1 = x + w, y1 = y + h;
+  int i = 0;
+  while (i < img->ndirty) {
+    const int *r = img->dirty[i];
+    if (r[0] <= x0 && r[1] <= y0 && x1 <= r[2] && y1 <= r[3])
+      return; // already covered
+    if (r[0] <= x1 && x0 <= r[2] && r[1] <= y1 && y0 <= r[3]) {
+      // Coalesce, and start over: the box may now touch earlier ones.
+      x0 = r[0] < x0 ? r[0] : x0;
+      y0 = r[1] < y0 ? r[1] : y0;
+      x1 = r[2] > x1 ? r[2] : x1;
+      y1 = r[3] > y1 ? r[3] : y1;
+      memcpy(img->dirty[i], img->dirty[--img->ndirty], sizeof(img->dirty[i]));
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+  if (img->ndirty == DIRTY_MAX) {
+    int best = 0;
+    int64_t growth = INT64_MAX;
+    for (i = 0; i < DIRTY_MAX; i++) {
+      const int *r = img->dirty[i];
+      int64_t bw = (r[2] > x1 ? r[2] : x1) - (r[0] < x0 ? r[0] : x0);
+      int64_t bh = (r[3] > y1 ? r[3] : y1) - (r[1] < y0 ? r[1] : y0);
+      int64_t g = bw * bh - (int64_t)(r[2] - r[0]) * (r[3] - r[1]);
+      if (g < growth) {
+        growth = g;
+        best = i;
+      }
+    }
+    const int *r = img->dirty[best];
+    x0 = r[0] < x0 ? r[0] : x0;
+    y0 = r[1] < y0 ? r[1] : y0;
+    x1 = r[2] > x1 ? r[2] : x1;
+    y1 = r[3] > y1 ? r[3] : y1;
+    memcpy(img->dirty[best], img->dirty[--img->ndirty],
+           sizeof(img->dirty[best]));
+    markDirty(img, x0, y0, x1 - x0, y1 - y0);
+    return;
+  }
+  int *r = img->dirty[img->ndirty++];
+  r[0] = x0;
+  r[1] = y0;
+  r[2] = x1;
+  r[3] = y1;
+}
+
+// Prepare to change the pixels of img in rectangle (x, y, w, h): make sure
+// they are not shared (see ownPixels), and mark them dirty.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static inline int willChange(Image img, int x, int y, int w, int h) {
+  if (!ownPixels(img))
+    return 0;
+  markDirty(img, x, y, w, h);
+  return 1;
+}
+
+/// Number of dirty rectangles of img.
+/// Together, they cover every pixel changed since the last ImageDirtyClear
+/// (or since img was created).
+int ImageDirtyCount(Image img) { ///
+  assert(img != NULL);
+  return img->ndirty;
+}
+
+/// Get dirty rectangle i of img, for 0 <= i < ImageDirtyCount(img).
+void ImageDirtyRect(Image img, int i, int *x, int *y, int *w, int *h) { ///
+  assert(img != NULL);
+  assert(0 <= i && i < img->ndirty);
+  const int *r = img->dirty[i];
+  *x = r[0];
+  *y = r[1];
+  *w = r[2] - r[0];
+  *h = r[3] - r[1];
+}
+
+/// Clear the dirty rectangles of img.
+void ImageDirtyClear(Image img) { ///
+  assert(img != NULL);
+  img->ndirty = 0;
+}
+
+/// Clone an image.
+/// The clone shares the pixels of img until either image is changed.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) { ///
+  assert(img != NULL);
+  Image clone = malloc(sizeof(struct image));
+  if (img->refs == NULL && clone != NULL) {
+    img->refs = malloc(sizeof(int));
+    if (img->refs != NULL)
+      *img->refs = 1;
+  }
+  if (clone == NULL || img->refs == NULL) {
+    free(clone);
+    errno = ENOMEM;
+    errCause = "Out of memory";
     return NULL;
   }
-  return img;
+  *clone = *img;
+  (*img->refs)++;
+  return clone;
 }
 
 /// Destroy the image pointed to by (*imgp).
@@ -197,11 +555,67 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image *imgp) { ///
   assert(imgp != NULL);
-  free((*imgp)->pixel);
-  free(*imgp);
+  Image img = *imgp;
+  if (img == NULL)
+    return;
+  if (img->refs != NULL) {
+    if (--*img->refs > 0) { // the pixels are still used by other images
+      free(img);
+      *imgp = NULL;
+      return;
+    }
+    free(img->refs);
+  }
+  poolLive -= img->capacity;
+  size_t cap;
+  int c = sizeClass(img->capacity, &cap);
+  if (cap == img->capacity && poolCached + cap <= poolLimit) {
+    img->next = poolFree[c];
+    poolFree[c] = img;
+    poolCached += cap;
+  } else {
+    freePixels(img);
+    free(img);
+  }
   *imgp = NULL;
 }
 
+/// Set the allocation policy for the pixels of new images.
+/// Returns the previous policy.
+AllocPolicy ImageSetAllocPolicy(AllocPolicy policy) { ///
+  AllocPolicy old = allocPolicy;
+  allocPolicy = policy;
+  return old;
+}
+
+/// Create a new black image, with pixels allocated following policy.
+/// Same as ImageCreate, but with the allocation policy for this image only.
+Image ImageCreateAlloc(int width, int height, uint8 maxval,
+                       AllocPolicy policy) { ///
+  return imageAlloc(width, height, maxval, 1, policy);
+}
+
+/// Set the image pool limit.
+/// Destroyed images are kept for reuse while the pool holds at most
+/// limit bytes of pixels; cached images beyond a lowered limit are freed.
+/// A limit of 0 (the default) turns pooling off.
+void ImagePoolSetLimit(size_t limit) { ///
+  poolLimit = limit;
+  poolTrim(limit);
+}
+
+/// Image pool statistics.
+/// Sets (*requests) to the number of images created so far, (*hits) to
+/// how many of those reused a pooled buffer, and (*footprint) and (*peak)
+/// to the current and maximum bytes of pixel buffers, live or pooled.
+void ImagePoolStats(uint64_t *requests, uint64_t *hits, size_t *footprint,
+                    size_t *peak) { ///
+  *requests = poolRequests;
+  *hits = poolHits;
+  *footprint = poolLive + poolCached;
+  *peak = poolPeak;
+}
+
 /// PGM file operations
 
 // See also:
@@ -219,6 +633,24 @@ static int skipComments(FILE *f) {
   return i;
 }
 
+// Parse a raw PGM header, up to the whitespace before the pixels.
+// On success, returns nonzero and sets (*w, *h, *maxval).
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int readHeader(FILE *f, int *w, int *h, int *maxval) {
+  char c;
+  return check(fscanf(f, "P%c ", &c) == 1 && c == '5',
+               "Invalid file format") &&
+         skipComments(f) >= 0 &&
+         check(fscanf(f, "%d ", w) == 1 && *w >= 0, "Invalid width") &&
+         skipComments(f) >= 0 &&
+         check(fscanf(f, "%d ", h) == 1 && *h >= 0, "Invalid height") &&
+         skipComments(f) >= 0 &&
+         check(fscanf(f, "%d", maxval) == 1 && 0 < *maxval &&
+                   *maxval <= (int)PixMax,
+               "Invalid maxval") &&
+         check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+}
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
@@ -227,25 +659,14 @@ static int skipComments(FILE *f) {
 Image ImageLoad(const char *filename) { ///
   int w, h;
   int maxval;
-  char c;
   FILE *f = NULL;
   Image img = NULL;
 
   int success =
       check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
-      // Parse PGM header
-      check(fscanf(f, "P%c ", &c) == 1 && c == '5', "Invalid file format") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &h) == 1 && h >= 0, "Invalid height") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d", &maxval) == 1 && 0 < maxval &&
-                maxval <= (int)PixMax,
-            "Invalid maxval") &&
-      check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
+      readHeader(f, &w, &h, &maxval) &&
       // Allocate image
-      (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+      (img = imageNew(w, h, (uint8)maxval, 0)) != NULL &&
       // Read pixels
       check(fread(img->pixel, sizeof(uint8), w * h, f) == w * h,
             "Reading pixels");
@@ -308,6 +729,52 @@ int ImageMaxval(Image img) { ///
   return img->maxval;
 }
 
+// Find the minimum and maximum of the size > 0 levels at p.
+static void minMax(const uint8 *p, size_t size, uint8 *min, uint8 *max) {
+  uint8 lo = p[0];
+  uint8 hi = lo;
+  size_t i = 0;
+#ifdef __SSE2__
+  if (size >= 64) {
+    // Four independent accumulators of each, to hide the latency.
+    __m128i vlo[4];
+    __m128i vhi[4];
+    for (int j = 0; j < 4; j++)
+      vlo[j] = vhi[j] = _mm_set1_epi8((char)lo);
+    for (; i + 64 <= size; i += 64) {
+      for (int j = 0; j < 4; j++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i + 16 * j));
+        vlo[j] = _mm_min_epu8(vlo[j], v);
+        vhi[j] = _mm_max_epu8(vhi[j], v);
+      }
+    }
+    __m128i l = _mm_min_epu8(_mm_min_epu8(vlo[0], vlo[1]),
+                             _mm_min_epu8(vlo[2], vlo[3]));
+    __m128i h = _mm_max_epu8(_mm_max_epu8(vhi[0], vhi[1]),
+                             _mm_max_epu8(vhi[2], vhi[3]));
+    // Fold the 16 lanes into lane 0.
+    l = _mm_min_epu8(l, _mm_srli_si128(l, 8));
+    h = _mm_max_epu8(h, _mm_srli_si128(h, 8));
+    l = _mm_min_epu8(l, _mm_srli_si128(l, 4));
+    h = _mm_max_epu8(h, _mm_srli_si128(h, 4));
+    l = _mm_min_epu8(l, _mm_srli_si128(l, 2));
+    h = _mm_max_epu8(h, _mm_srli_si128(h, 2));
+    l = _mm_min_epu8(l, _mm_srli_si128(l, 1));
+    h = _mm_max_epu8(h, _mm_srli_si128(h, 1));
+    lo = (uint8)_mm_cvtsi128_si32(l);
+    hi = (uint8)_mm_cvtsi128_si32(h);
+  }
+#endif
+  for (; i < size; i++) {
+    if (p[i] < lo)
+      lo = p[i];
+    if (p[i] > hi)
+      hi = p[i];
+  }
+  *min = lo;
+  *max = hi;
+}
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
@@ -315,13 +782,64 @@ int ImageMaxval(Image img) { ///
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8 *min, uint8 *max) { ///
   assert(img != NULL);
-  *min = *max = img->pixel[0];
-  for (int i = 0; i < img->width * img->height; i++) {
-    if (img->pixel[i] < *min)
-      *min = img->pixel[i];
-    if (img->pixel[i] > *max)
-      *max = img->pixel[i];
+  size_t size = (size_t)img->width * img->height;
+  *min = *max = 0;
+  if (size > 0)
+    minMax(img->pixel, size, min, max);
+  PIXMEM += (unsigned long)size;
+}
+
+// Count the pixels of each gray level in p[0..size-1], in hist.
+static void histogram(const uint8 *p, size_t size, uint32_t hist[256]) {
+  // Consecutive pixels often have the same level, so counting them all in
+  // the same bin would make each increment wait for the previous one to
+  // be stored.  Four sub-histograms, used in turn, avoid that.
+  uint32_t sub[4][256];
+  memset(sub, 0, sizeof(sub));
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t v;
+    memcpy(&v, p + i, 8);
+    sub[0][v & 0xff]++;
+    sub[1][(v >> 8) & 0xff]++;
+    sub[2][(v >> 16) & 0xff]++;
+    sub[3][(v >> 24) & 0xff]++;
+    sub[0][(v >> 32) & 0xff]++;
+    sub[1][(v >> 40) & 0xff]++;
+    sub[2][(v >> 48) & 0xff]++;
+    sub[3][v >> 56]++;
+  }
+  for (; i < size; i++)
+    sub[i % 4][p[i]]++;
+  for (int l = 0; l < 256; l++)
+    hist[l] = sub[0][l] + sub[1][l] + sub[2][l] + sub[3][l];
+  PIXMEM += (unsigned long)size;
+}
+
+/// Pixel histogram
+/// Count the pixels of each gray level in image.
+void ImageHistogram(Image img, uint32_t hist[256]) { ///
+  assert(img != NULL);
+  assert(hist != NULL);
+  histogram(img->pixel, (size_t)img->width * img->height, hist);
+}
+
+/// Mean and standard deviation of the levels counted in a histogram.
+void ImageHistogramMoments(const uint32_t hist[256], double *mean,
+                           double *stddev) { ///
+  assert(hist != NULL);
+  uint64_t n = 0;
+  uint64_t sum = 0;
+  uint64_t sq = 0;
+  for (uint64_t l = 0; l < 256; l++) {
+    n += hist[l];
+    sum += l * hist[l];
+    sq += l * l * hist[l];
   }
+  double m = n > 0 ? (double)sum / (double)n : 0.0;
+  double var = n > 0 ? ((double)sq - (double)sum * m) / (double)n : 0.0;
+  *mean = m;
+  *stddev = var > 0.0 ? sqrt(var) : 0.0;
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -366,52 +884,67 @@ uint8 ImageGetPixel(Image img, int x, int y) { ///
 }
 
 /// Set the pixel at position (x,y) to new level.
-void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
+int ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
+  if (!willChange(img, x, y, 1, 1))
+    return 0;
   PIXMEM += 1; // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
+  return 1;
 }
 
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place: no allocation involved,
+/// except for a copy of the pixels if they are shared with a clone (see
+/// ImageClone).  They only fail if that copy cannot be allocated.
+/// On success, they return nonzero.
+/// On failure, they return 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) { ///
+int ImageNegative(Image img) { ///
   assert(img != NULL);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
 
   int size = img->width * img->height;
 
   for (int i = 0; i < size; i++) {
     img->pixel[i] = img->maxval - img->pixel[i];
   }
+  return 1;
 }
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) { ///
+int ImageThreshold(Image img, uint8 thr) { ///
   assert(img != NULL);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
 
   int size = img->width * img->height;
 
   for (int i = 0; i < size; i++) {
     img->pixel[i] = img->pixel[i] < thr ? 0 : img->maxval;
   }
+  return 1;
 }
 
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) {
+int ImageBrighten(Image img, double factor) {
   assert(img != NULL);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
 
   for (int i = 0; i < img->width * img->height; i++) {
     uint8 *pixel = &img->pixel[i];
@@ -421,6 +954,7 @@ void ImageBrighten(Image img, double factor) {
              : newPixelValue < 0.0               ? 0
                                                  : (uint8)(newPixelValue + 0.5);
   }
+  return 1;
 }
 
 /// Geometric transformations
@@ -436,6 +970,9 @@ void ImageBrighten(Image img, double factor) {
 // Implementation hint:
 // Call ImageCreate whenever you need a new image!
 
+// Side of the square tiles rotated at a time
+#define ROTATE_TILE 32
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees anti-clockwise.
@@ -447,18 +984,28 @@ void ImageBrighten(Image img, double factor) {
 Image ImageRotate(Image img) { ///
   assert(img != NULL);
 
-  Image rotated_image = ImageCreate(img->height, img->width, img->maxval);
+  Image rotated_image = imageNew(img->height, img->width, img->maxval, 0);
   if (rotated_image == NULL) {
     errno = ENOMEM;
     return NULL;
   }
 
-  for (int y = 0; y < img->height; y++) {
-    for (int x = 0; x < img->width; x++) {
-      ImageSetPixel(rotated_image, y, img->width - x - 1,
-                    ImageGetPixel(img, x, y));
+  // Column x of img becomes row (w-1-x) of the result.  This goes by
+  // tiles, so that the rows of img read down each column stay in cache.
+  int w = img->width;
+  int h = img->height;
+  for (int y0 = 0; y0 < h; y0 += ROTATE_TILE) {
+    int y1 = y0 + ROTATE_TILE < h ? y0 + ROTATE_TILE : h;
+    for (int x0 = 0; x0 < w; x0 += ROTATE_TILE) {
+      int x1 = x0 + ROTATE_TILE < w ? x0 + ROTATE_TILE : w;
+      for (int x = x0; x < x1; x++) {
+        uint8 *out = rotated_image->pixel + (size_t)(w - 1 - x) * h;
+        for (int y = y0; y < y1; y++)
+          out[y] = img->pixel[(size_t)y * w + x];
+      }
     }
   }
+  PIXMEM += 2 * (unsigned long)w * h; // 1 read + 1 write per pixel
 
   return rotated_image;
 }
@@ -473,18 +1020,20 @@ Image ImageRotate(Image img) { ///
 Image ImageMirror(Image img) { ///
   assert(img != NULL);
 
-  Image mirrored_image = ImageCreate(img->width, img->height, img->maxval);
+  Image mirrored_image = imageNew(img->width, img->height, img->maxval, 0);
   if (mirrored_image == NULL) {
     errno = ENOMEM;
     return NULL;
   }
 
+  int w = img->width;
   for (int y = 0; y < img->height; y++) {
-    for (int x = 0; x < img->width; x++) {
-      ImageSetPixel(mirrored_image, img->width - x - 1, y,
-                    ImageGetPixel(img, x, y));
-    }
+    const uint8 *in = img->pixel + (size_t)y * w;
+    uint8 *out = mirrored_image->pixel + (size_t)y * w;
+    for (int x = 0; x < w; x++)
+      out[w - 1 - x] = in[x];
   }
+  PIXMEM += 2 * (unsigned long)w * img->height; // 1 read + 1 write per pixel
 
   return mirrored_image;
 }
@@ -505,26 +1054,16 @@ Image ImageCrop(Image img, int x, int y, int w, int h) {
   assert(img != NULL);
   assert(ImageValidRect(img, x, y, w, h));
 
-  Image cropped_image = ImageCreate(w, h, img->maxval);
+  Image cropped_image = imageNew(w, h, img->maxval, 0);
   if (cropped_image == NULL) {
     errno = ENOMEM;
     return NULL;
   }
 
-  int img_width = ImageWidth(img);
-  int img_height = ImageHeight(img);
-
-  uint8 corner_lu = img->pixel[G(img, x, y)];
-  // Fill corners
-  // Top left
-  for (int i = 0; i < h; i++) {
-    for (int j = 0; j < w; j++) {
-      ImageSetPixel(cropped_image, j, i,
-                    x + j < img_width && y + i < img_height
-                        ? img->pixel[G(img, x + j, y + i)]
-                        : corner_lu);
-    }
-  }
+  for (int i = 0; i < h; i++)
+    memcpy(cropped_image->pixel + (size_t)i * w, img->pixel + G(img, x, y + i),
+           w);
+  PIXMEM += (unsigned long)w * h; // count one write per pixel
 
   return cropped_image;
 }
@@ -533,35 +1072,63 @@ Image ImageCrop(Image img, int x, int y, int w, int h) {
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place (see Pixel transformations).
 /// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) { ///
+int ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  if (!willChange(img1, x, y, img2->width, img2->height))
+    return 0;
+  // Rows are copied whole (memmove: img2 may be img1, pasted onto itself).
   for (int cy = 0; cy < img2->height; cy++) {
-    for (int cx = 0; cx < img2->width; cx++) {
-      ImageSetPixel(img1, x + cx, y + cy, ImageGetPixel(img2, cx, cy));
-    }
+    memmove(img1->pixel + (size_t)(y + cy) * img1->width + x,
+            img2->pixel + (size_t)cy * img2->width, (size_t)img2->width);
+  }
+  PIXMEM += 2 * (unsigned long)img2->width * img2->height;
+  return 1;
+}
+
+/// Paste a rectangle of an image into another image.
+/// Paste the rectangle (x2, y2, w, h) of img2 into position (x, y) of img1.
+/// This modifies img1 in-place (see Pixel transformations).
+/// Requires: the rectangle is inside img2, and fits inside img1 at (x, y);
+/// img1 and img2 are different images.
+int ImagePasteRect(Image img1, int x, int y, Image img2, int x2, int y2,
+                   int w, int h) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidRect(img1, x, y, w, h));
+  assert(ImageValidRect(img2, x2, y2, w, h));
+  assert(img1 != img2);
+  if (!willChange(img1, x, y, w, h))
+    return 0;
+  for (int cy = 0; cy < h; cy++) {
+    memcpy(img1->pixel + (size_t)(y + cy) * img1->width + x,
+           img2->pixel + (size_t)(y2 + cy) * img2->width + x2, (size_t)w);
   }
+  PIXMEM += 2 * (unsigned long)w * h;
+  return 1;
 }
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place (see Pixel transformations).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {
+int ImageBlend(Image img1, int x, int y, Image img2, double alpha) {
   assert(img1 != NULL);
   assert(img2 != NULL);
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  if (!willChange(img1, x, y, img2->width, img2->height))
+    return 0;
 
   for (int cy = 0; cy < img2->height; cy++) {
+    uint8 *row1 = img1->pixel + (size_t)(y + cy) * img1->width + x;
+    const uint8 *row2 = img2->pixel + (size_t)cy * img2->width;
     for (int cx = 0; cx < img2->width; cx++) {
-      uint8 pixel = ImageGetPixel(img1, x + cx, y + cy);
-      double newPixelValue =
-          pixel * (1.0 - alpha) + ImageGetPixel(img2, cx, cy) * alpha;
+      double newPixelValue = row1[cx] * (1.0 - alpha) + row2[cx] * alpha;
 
       // Ensure the newPixelValue is within the valid range [0, img1->maxval]
       if (newPixelValue > (double)img1->maxval) {
@@ -573,9 +1140,11 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {
       // Round the newPixelValue to the nearest integer
       int roundedValue = (int)(newPixelValue + 0.5);
 
-      ImageSetPixel(img1, x + cx, y + cy, (uint8)roundedValue);
+      row1[cx] = (uint8)roundedValue;
     }
   }
+  PIXMEM += 3 * (unsigned long)img2->width * img2->height; // 2 reads, 1 store
+  return 1;
 }
 
 /// Compare an image to a subimage of a larger image.
@@ -612,8 +1181,9 @@ int ImageLocateSubImage(Image img1, int *px, int *py, Image img2) { ///
   // check if img2 fits inside img1
   assert(ImageValidRect(img1, 0, 0, img2->width, img2->height));
 
-  int width1 = ImageWidth(img1);
-  int height1 = ImageHeight(img1);
+  // only positions where img2 fits inside img1
+  int width1 = ImageWidth(img1) - ImageWidth(img2) + 1;
+  int height1 = ImageHeight(img1) - ImageHeight(img2) + 1;
   int size1 = width1 * height1;
 
   for (int i = 0; i < size1; i++) {
@@ -631,71 +1201,3518 @@ int ImageLocateSubImage(Image img1, int *px, int *py, Image img2) { ///
   return 0; // No match found
 }
 
-/// Filtering
+// Check if no byte of a[0..n-1] differs by more than tol from b[0..n-1].
+// With SSE2, |a-b| is computed with saturating subtractions in both
+// directions, and the whole row is checked before branching.
+static inline int rowWithin(const uint8 *a, const uint8 *b, int n,
+                            uint8 tol) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i vtol = _mm_set1_epi8((char)tol);
+  __m128i over = _mm_setzero_si128(); // accumulates |a-b| - tol (saturated)
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+    over = _mm_or_si128(over, _mm_subs_epu8(diff, vtol));
+  }
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(over, _mm_setzero_si128())) != 0xFFFF)
+    return 0;
+#endif
+  int over1 = 0;
+  for (; i < n; i++)
+    over1 |= (a[i] > b[i] ? a[i] - b[i] : b[i] - a[i]) > tol;
+  return !over1;
+}
 
-/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
-/// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
+/// Compare an image to a subimage of a larger image, with tolerance.
+/// Returns 1 (true) if no pixel of img2 differs by more than tol from the
+/// corresponding pixel of the subimage of img1 at pos (x, y).
+/// Returns 0, otherwise.
+int ImageMatchSubImageTol(Image img1, int x, int y, Image img2,
+                          uint8 tol) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
 
-void ImageBlur(Image img, int dx, int dy) {
-  assert(img != NULL);
-  assert(dx >= 0 && dy >= 0);
-  assert(2 * dx + 1 <= img->width && 2 * dy + 1 <= img->height);
+  // row by row, stopping at the first row with any violation
+  for (int j = 0; j < img2->height; j++) {
+    ILSI_ITS += (unsigned long)img2->width;
+    PIXMEM += 2 * (unsigned long)img2->width;
+    if (!rowWithin(img1->pixel + (y + j) * img1->width + x,
+                   img2->pixel + j * img2->width, img2->width, tol)) {
+      return 0;
+    }
+  }
+  return 1;
+}
 
-  int width = ImageWidth(img);
-  int height = ImageHeight(img);
-  int size = width * height;
-  int *cumsum = malloc(sizeof(int) * size);
-
-  // the loop has the number of iterations of the size of the image plus the
-  // size of half of the rectangle to compensate for the delay in the blurring
-  // effect ( delay = half of the rectangle size ) when half of the size of the
-  // rectangle is claculated you can already start blurring the first pixel
-  for (int i = 0; i < size + width * (dy + 1); i++) {
-    BLUR_ITS += 1;
-    int x = i % width;
-    int y = i / width;
-
-    // calculate the cumulative sum of the rectangle
-    if (i < size) { // only until the end of the image
-      int pixelValue = ImageGetPixel(img, x, y);
-      int sum = pixelValue;
-      if (x > 0)
-        sum += *(cumsum + i - 1);
-      if (y > 0)
-        sum += *(cumsum + i - width);
-      if (x > 0 && y > 0)
-        sum -= *(cumsum + i - width - 1);
-      *(cumsum + i) = sum;
-    }
-
-    // after the half of the rectangle is calculated, start blurring
-    if (i >= width * (dy + 1)) {
-      // adjust the index to the correct position in the image
-      int blur_index = i - width * (dy + 1);
-
-      int bx = blur_index % width;
-      int by = blur_index / width;
-      int left = (bx > dx) ? bx - dx : 0;
-      int right = (bx + dx < width) ? bx + dx : width - 1;
-      int top = (by > dy) ? by - dy : 0;
-      int bottom = (by + dy < height) ? by + dy : height - 1;
-
-      int _sum = *(cumsum + bottom * width + right);
-      if (left > 0)
-        _sum -= *(cumsum + (bottom * width + (left - 1)));
-      if (top > 0)
-        _sum -= *(cumsum + ((top - 1) * width + right));
-      if (left > 0 && top > 0)
-        _sum += *(cumsum + ((top - 1) * width + (left - 1)));
-      int rectArea = (right - left + 1) * (bottom - top + 1);
-      uint8 blurredPixel = (uint8)((_sum + rectArea / 2) / rectArea);
-
-      // since the blurring is done with the cumulative sum
-      // it's possible to update the image in place
-      ImageSetPixel(img, bx, by, blurredPixel);
-    }
-  }
-  free(cumsum);
+/// Locate a subimage inside another image, with tolerance.
+/// Same as ImageLocateSubImage, but matching with ImageMatchSubImageTol.
+int ImageLocateSubImageTol(Image img1, int *px, int *py, Image img2,
+                           uint8 tol) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidRect(img1, 0, 0, img2->width, img2->height));
+
+  // same scan order as ImageLocateSubImage
+  int width1 = img1->width - img2->width + 1;
+  int height1 = img1->height - img2->height + 1;
+  int size1 = width1 * height1;
+
+  for (int i = 0; i < size1; i++) {
+    int cx = i % width1;
+    int cy = i / width1;
+    if (ImageMatchSubImageTol(img1, cx, cy, img2, tol)) {
+      *px = cx;
+      *py = cy;
+      return 1;
+    }
+  }
+  return 0; // No match found
+}
+
+/// Multi-template search
+
+// Aho-Corasick automaton over an integer alphabet.
+// ImageLocateSubImages uses two of these (Baker-Bird): one over pixel
+// levels, to recognize the rows of the subimages, and one over row ids,
+// to recognize their columns.
+//
+// All patterns inserted in one automaton have the same length, so at most
+// one pattern can end at each text position, and it ends there iff the
+// current state has full depth.  Therefore, no output links are needed.
+//
+// Goto edges are stored in an open-addressing hash table keyed by
+// (state, symbol), so memory is proportional to the number of states
+// and not to states*alphabet.  The trie is also kept as first-child /
+// next-sibling lists, to compute failure links in BFS order.
+struct acAutomaton {
+  int nstates;  // number of states in use (state 0 is the root)
+  int *fail;    // failure link of each state
+  int *depth;   // depth of each state in the trie
+  int *sym;     // symbol on the edge leading to each state
+  int *child;   // first child of each state (-1 if none)
+  int *sibling; // next sibling of each state (-1 if none)
+  int *out;     // id of the pattern ending at each state (-1 if none)
+  int hmask;    // hash table capacity - 1 (capacity is a power of 2)
+  int *hstate;  // hash table keys: source state (-1 for empty slot)
+  int *hsym;    //   and symbol
+  int *hnext;   // hash table values: destination state
+};
+
+// Hash of a (state, symbol) pair.
+static inline unsigned acHash(int state, int sym) {
+  uint64_t k = ((uint64_t)(unsigned)state << 32) | (unsigned)sym;
+  return (unsigned)((k * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+// Get the goto edge (state, sym) of the trie, or -1 if there is none.
+static inline int acFind(struct acAutomaton *ac, int state, int sym) {
+  unsigned h = acHash(state, sym) & ac->hmask;
+  while (ac->hstate[h] >= 0) {
+    if (ac->hstate[h] == state && ac->hsym[h] == sym)
+      return ac->hnext[h];
+    h = (h + 1) & ac->hmask;
+  }
+  return -1;
+}
+
+// Release memory held by an automaton (even if partially initialized).
+static void acFree(struct acAutomaton *ac) {
+  free(ac->fail);
+  free(ac->depth);
+  free(ac->sym);
+  free(ac->child);
+  free(ac->sibling);
+  free(ac->out);
+  free(ac->hstate);
+  free(ac->hsym);
+  free(ac->hnext);
+}
+
+// Initialize an empty automaton able to hold up to maxstates states.
+// On failure, returns 0 and errno/errCause are set (acFree must still be
+// called).
+static int acInit(struct acAutomaton *ac, int maxstates) {
+  int hcap = 2;
+  while (hcap < 2 * maxstates)
+    hcap *= 2;
+  ac->nstates = 1;
+  ac->hmask = hcap - 1;
+  ac->fail = malloc(maxstates * sizeof(int));
+  ac->depth = malloc(maxstates * sizeof(int));
+  ac->sym = malloc(maxstates * sizeof(int));
+  ac->child = malloc(maxstates * sizeof(int));
+  ac->sibling = malloc(maxstates * sizeof(int));
+  ac->out = malloc(maxstates * sizeof(int));
+  ac->hstate = malloc(hcap * sizeof(int));
+  ac->hsym = malloc(hcap * sizeof(int));
+  ac->hnext = malloc(hcap * sizeof(int));
+  if (!check(ac->fail != NULL && ac->depth != NULL && ac->sym != NULL &&
+                 ac->child != NULL && ac->sibling != NULL &&
+                 ac->out != NULL && ac->hstate != NULL && ac->hsym != NULL &&
+                 ac->hnext != NULL,
+             "Out of memory")) {
+    errno = ENOMEM;
+    return 0;
+  }
+  for (int h = 0; h < hcap; h++)
+    ac->hstate[h] = -1;
+  ac->fail[0] = ac->depth[0] = 0;
+  ac->sym[0] = ac->child[0] = ac->sibling[0] = ac->out[0] = -1;
+  return 1;
+}
+
+// Insert pattern pat[0..len-1] in the trie.
+// If an identical pattern was inserted before, returns its id;
+// otherwise, the pattern gets id newid, which is returned.
+static int acInsert(struct acAutomaton *ac, const int *pat, int len,
+                    int newid) {
+  int s = 0;
+  for (int i = 0; i < len; i++) {
+    int t = acFind(ac, s, pat[i]);
+    if (t < 0) {
+      t = ac->nstates++;
+      ac->depth[t] = ac->depth[s] + 1;
+      ac->sym[t] = pat[i];
+      ac->child[t] = ac->out[t] = -1;
+      ac->sibling[t] = ac->child[s];
+      ac->child[s] = t;
+      unsigned h = acHash(s, pat[i]) & ac->hmask;
+      while (ac->hstate[h] >= 0)
+        h = (h + 1) & ac->hmask;
+      ac->hstate[h] = s;
+      ac->hsym[h] = pat[i];
+      ac->hnext[h] = t;
+    }
+    s = t;
+  }
+  if (ac->out[s] < 0)
+    ac->out[s] = newid;
+  return ac->out[s];
+}
+
+// Compute the failure links of all states, in BFS order.
+// On failure, returns 0 and errno/errCause are set.
+static int acBuild(struct acAutomaton *ac) {
+  int *queue = malloc(ac->nstates * sizeof(int));
+  if (!check(queue != NULL, "Out of memory")) {
+    errno = ENOMEM;
+    return 0;
+  }
+  int head = 0;
+  int tail = 0;
+  queue[tail++] = 0;
+  while (head < tail) {
+    int u = queue[head++];
+    for (int t = ac->child[u]; t >= 0; t = ac->sibling[t]) {
+      queue[tail++] = t;
+      if (u == 0) {
+        ac->fail[t] = 0;
+        continue;
+      }
+      // longest proper suffix of t that is also a prefix in the trie
+      int f = ac->fail[u];
+      int g;
+      while ((g = acFind(ac, f, ac->sym[t])) < 0 && f != 0)
+        f = ac->fail[f];
+      ac->fail[t] = g >= 0 ? g : 0;
+    }
+  }
+  free(queue);
+  return 1;
+}
+
+// Advance the automaton from state s on symbol sym.
+static inline int acStep(struct acAutomaton *ac, int s, int sym) {
+  int t;
+  while ((t = acFind(ac, s, sym)) < 0 && s != 0)
+    s = ac->fail[s];
+  return t >= 0 ? t : 0;
+}
+
+/// Locate several subimages inside another image, in a single pass.
+/// Searches for each of the n images img2[0..n-1] inside img1.
+/// On return, (px[i], py[i]) is set to the first matching position of
+/// img2[i], or to (-1, -1) if img2[i] was not found.
+/// Returns the number of subimages found, or -1 on failure.
+int ImageLocateSubImages(Image img1, int n, Image img2[], int px[],
+                         int py[]) { ///
+  assert(img1 != NULL);
+  assert(n >= 0);
+  for (int t = 0; t < n; t++) {
+    assert(img2[t] != NULL);
+    assert(img2[t]->width == img2[0]->width);
+    assert(img2[t]->height == img2[0]->height);
+    px[t] = py[t] = -1;
+  }
+  if (n == 0)
+    return 0;
+  assert(ImageValidRect(img1, 0, 0, img2[0]->width, img2[0]->height));
+
+  int width1 = img1->width;
+  int height1 = img1->height;
+  int w = img2[0]->width;
+  int h = img2[0]->height;
+
+  struct acAutomaton rows = {0};
+  struct acAutomaton cols = {0};
+  int *pattern = malloc((w > h ? w : h) * sizeof(int));
+  int *rowid = malloc(n * h * sizeof(int));    // row ids of each subimage
+  int *same = malloc(n * sizeof(int));         // next identical subimage
+  int *colstate = calloc(width1, sizeof(int)); // column automaton states
+  int found = -1;
+
+  int success =
+      check(pattern != NULL && rowid != NULL && same != NULL &&
+                colstate != NULL,
+            "Out of memory") &&
+      acInit(&rows, n * h * w + 1) && acInit(&cols, n * h + 1);
+  if (success) {
+    // Each distinct row of the subimages gets an id...
+    int nrowids = 0;
+    for (int t = 0; t < n; t++) {
+      for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++)
+          pattern[x] = img2[t]->pixel[y * w + x];
+        rowid[t * h + y] = acInsert(&rows, pattern, w, nrowids);
+        if (rowid[t * h + y] == nrowids)
+          nrowids++;
+      }
+      PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+    }
+    // ...and each subimage is a column of row ids.
+    // Identical subimages are chained, as they share the final state.
+    for (int t = 0; t < n; t++) {
+      same[t] = -1;
+      int first = acInsert(&cols, &rowid[t * h], h, t);
+      if (first != t) {
+        int u = first;
+        while (same[u] >= 0)
+          u = same[u];
+        same[u] = t;
+      }
+    }
+    success = acBuild(&rows) && acBuild(&cols);
+  }
+
+  if (success) {
+    // Scan img1 once.  Matches are detected at their bottom-right corner,
+    // in raster order of their top-left corner, so the first match of
+    // each subimage is the one ImageLocateSubImage would return.
+    found = 0;
+    for (int y = 0; y < height1 && found < n; y++) {
+      const uint8 *line = img1->pixel + y * width1;
+      int s = 0;
+      for (int x = 0; x < width1; x++) {
+        ILSI_ITS += 1;
+        s = acStep(&rows, s, line[x]);
+        if (x < w - 1)
+          continue;
+        // id of the subimage row that ends at (x, y), if any
+        int id = rows.depth[s] == w ? rows.out[s] : -1;
+        int c = id >= 0 ? acStep(&cols, colstate[x], id) : 0;
+        colstate[x] = c;
+        if (cols.depth[c] == h) {
+          for (int t = cols.out[c]; t >= 0; t = same[t]) {
+            if (px[t] < 0) {
+              px[t] = x - w + 1;
+              py[t] = y - h + 1;
+              found++;
+            }
+          }
+        }
+      }
+      PIXMEM += (unsigned long)width1; // count pixel memory accesses
+    }
+  }
+
+  acFree(&rows);
+  acFree(&cols);
+  free(pattern);
+  free(rowid);
+  free(same);
+  free(colstate);
+  return found;
+}
+
+/// Integral images
+
+// Internal structure for integral images (summed-area tables).
+// Both tables have an extra leading row and column of zeros:
+// sum[(y+1)*(width+1) + (x+1)] is the sum of all pixels in [0, x]x[0, y].
+struct integralImage {
+  int width, height;
+  uint64_t *sum; // sums of pixel levels
+  uint64_t *sq;  // sums of squared pixel levels (NULL if not requested)
+};
+
+// Allocate an integral image for a width x height image.
+static IntegralImage integralAlloc(int width, int height, int squares) {
+  size_t size = ((size_t)width + 1) * ((size_t)height + 1);
+  IntegralImage ii = malloc(sizeof(struct integralImage));
+  uint64_t *s = malloc(size * sizeof(uint64_t));
+  uint64_t *s2 = squares ? malloc(size * sizeof(uint64_t)) : NULL;
+  if (!check(ii != NULL && s != NULL && (s2 != NULL || !squares),
+             "Out of memory")) {
+    free(ii);
+    free(s);
+    free(s2);
+    errno = ENOMEM;
+    return NULL;
+  }
+  ii->width = width;
+  ii->height = height;
+  ii->sum = s;
+  ii->sq = s2;
+  return ii;
+}
+
+// Fill (or refill) the tables of ii with the sums of img, for the pixels
+// right of column x0 and below row y0 (inclusive); the sums over the other
+// pixels must be up to date already.
+static void integralFill(IntegralImage ii, Image img, int x0, int y0) {
+  int w = img->width;
+  int h = img->height;
+  size_t stride = (size_t)w + 1;
+  assert(ii->width == w && ii->height == h);
+
+  if (y0 == 0) {
+    memset(ii->sum, 0, stride * sizeof(uint64_t));
+    if (ii->sq != NULL)
+      memset(ii->sq, 0, stride * sizeof(uint64_t));
+  }
+  for (int y = y0; y < h; y++) {
+    const uint8 *p = img->pixel + (size_t)y * w;
+    uint64_t *prev = ii->sum + (size_t)y * stride;
+    uint64_t *cur = prev + stride;
+    cur[0] = 0;
+    uint64_t row = cur[x0] - prev[x0]; // sum of the row, left of x0
+    for (int x = x0; x < w; x++) {
+      row += p[x];
+      cur[x + 1] = prev[x + 1] + row;
+    }
+    if (ii->sq != NULL) {
+      prev = ii->sq + (size_t)y * stride;
+      cur = prev + stride;
+      cur[0] = 0;
+      row = cur[x0] - prev[x0];
+      for (int x = x0; x < w; x++) {
+        row += (uint64_t)p[x] * p[x];
+        cur[x + 1] = prev[x + 1] + row;
+      }
+    }
+  }
+  PIXMEM += (unsigned long)(w - x0) * (h - y0);
+}
+
+/// Create the integral image of img.
+/// On success, a new integral image is returned.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+IntegralImage IntegralImageCreate(Image img, int squares) { ///
+  assert(img != NULL);
+  IntegralImage ii = integralAlloc(img->width, img->height, squares);
+  if (ii != NULL)
+    integralFill(ii, img, 0, 0);
+  return ii;
+}
+
+/// Bring the integral image of img up to date, after img was changed.
+/// Only the sums that include dirty pixels (those right of and below the
+/// top left corner of the dirty rectangles, see ImageDirtyCount) are
+/// recomputed.
+/// Requires: ii was built from img (as it was when its dirty rectangles
+/// were last cleared).
+void IntegralImageUpdate(IntegralImage ii, Image img) { ///
+  assert(ii != NULL && img != NULL);
+  assert(ii->width == img->width && ii->height == img->height);
+  if (img->ndirty == 0)
+    return;
+  int x0 = img->width;
+  int y0 = img->height;
+  for (int i = 0; i < img->ndirty; i++) {
+    x0 = img->dirty[i][0] < x0 ? img->dirty[i][0] : x0;
+    y0 = img->dirty[i][1] < y0 ? img->dirty[i][1] : y0;
+  }
+  integralFill(ii, img, x0, y0);
+}
+
+/// Destroy the integral image pointed to by (*iip).
+void IntegralImageDestroy(IntegralImage *iip) { ///
+  assert(iip != NULL);
+  if (*iip == NULL)
+    return;
+  free((*iip)->sum);
+  free((*iip)->sq);
+  free(*iip);
+  *iip = NULL;
+}
+
+/// Get the width of the image that ii was built from.
+int IntegralImageWidth(IntegralImage ii) { ///
+  assert(ii != NULL);
+  return ii->width;
+}
+
+/// Get the height of the image that ii was built from.
+int IntegralImageHeight(IntegralImage ii) { ///
+  assert(ii != NULL);
+  return ii->height;
+}
+
+// Sum of table t (of integral image ii) over rectangle (x, y, w, h).
+static inline uint64_t tableRect(IntegralImage ii, const uint64_t *t, int x,
+                                 int y, int w, int h) {
+  size_t stride = (size_t)ii->width + 1;
+  const uint64_t *top = t + (size_t)y * stride + x;
+  const uint64_t *bottom = top + (size_t)h * stride;
+  return bottom[w] - top[w] - bottom[0] + top[0];
+}
+
+/// Sum of the pixel levels in rectangle (x, y, w, h).
+uint64_t IntegralImageRectSum(IntegralImage ii, int x, int y, int w,
+                              int h) { ///
+  assert(ii != NULL);
+  assert(0 <= x && x <= ii->width - w && 0 <= y && y <= ii->height - h);
+  return tableRect(ii, ii->sum, x, y, w, h);
+}
+
+/// Sum of the squared pixel levels in rectangle (x, y, w, h).
+uint64_t IntegralImageRectSumSq(IntegralImage ii, int x, int y, int w,
+                                int h) { ///
+  assert(ii != NULL && ii->sq != NULL);
+  assert(0 <= x && x <= ii->width - w && 0 <= y && y <= ii->height - h);
+  return tableRect(ii, ii->sq, x, y, w, h);
+}
+
+/// Mean of the pixel levels in rectangle (x, y, w, h).
+double IntegralImageRectMean(IntegralImage ii, int x, int y, int w,
+                             int h) { ///
+  assert(w > 0 && h > 0);
+  return (double)IntegralImageRectSum(ii, x, y, w, h) / ((double)w * h);
+}
+
+/// Variance of the pixel levels in rectangle (x, y, w, h).
+double IntegralImageRectVariance(IntegralImage ii, int x, int y, int w,
+                                 int h) { ///
+  assert(w > 0 && h > 0);
+  double n = (double)w * h;
+  double mean = (double)IntegralImageRectSum(ii, x, y, w, h) / n;
+  double var = (double)IntegralImageRectSumSq(ii, x, y, w, h) / n - mean * mean;
+  return var > 0.0 ? var : 0.0; // rounding may give tiny negative values
+}
+
+// Rounded mean (sum + area/2) / area, given inv = 1.0/area: multiplying
+// by the inverse and correcting the (rare) rounding errors is much faster
+// than integer division.
+// (Signed conversions are used, as they are single instructions on x86.)
+static inline uint8 meanRound(uint64_t sum, uint64_t area, double inv) {
+  int64_t num = (int64_t)(sum + area / 2);
+  int64_t q = (int64_t)((double)num * inv);
+  q -= q * (int64_t)area > num;
+  q += (q + 1) * (int64_t)area <= num;
+  return (uint8)q;
+}
+
+// Blur row y of the image that ii was built from into out.
+static void blurRow(IntegralImage ii, int y, int dx, int dy, uint8 *out) {
+  int width = ii->width;
+  int height = ii->height;
+  size_t stride = (size_t)width + 1;
+  int top = y > dy ? y - dy : 0;
+  int bottom = y + dy < height ? y + dy + 1 : height; // exclusive
+  const uint64_t *t = ii->sum + (size_t)top * stride;
+  const uint64_t *b = ii->sum + (size_t)bottom * stride;
+  uint64_t rh = (uint64_t)(bottom - top);
+  // Pixels [x0, x1) have full width windows, hence the same area.
+  int x0 = dx < width ? dx : width;
+  int x1 = width - dx > x0 ? width - dx : x0;
+  uint64_t area = rh * (uint64_t)(2 * dx + 1);
+  double inv = 1.0 / (double)area;
+  for (int x = x0; x < x1; x++) {
+    out[x] = meanRound(b[x + dx + 1] - t[x + dx + 1] - b[x - dx] + t[x - dx],
+                       area, inv);
+  }
+  for (int x = 0; x < width; x++) {
+    if (x == x0)
+      x = x1;
+    if (x >= width)
+      break;
+    int left = x > dx ? x - dx : 0;
+    int right = x + dx < width ? x + dx + 1 : width; // exclusive
+    area = rh * (uint64_t)(right - left);
+    uint64_t sum = b[right] - t[right] - b[left] + t[left];
+    out[x] = (uint8)((sum + area / 2) / area);
+  }
+  BLUR_ITS += (unsigned long)width;
+}
+
+/// Blur an image using the integral image of its original contents.
+int ImageBlurIntegral(Image img, IntegralImage ii, int dx, int dy) { ///
+  assert(img != NULL && ii != NULL);
+  assert(img->width == ii->width && img->height == ii->height);
+  assert(dx >= 0 && dy >= 0);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+
+  for (int y = 0; y < img->height; y++)
+    blurRow(ii, y, dx, dy, img->pixel + (size_t)y * img->width);
+  PIXMEM += (unsigned long)img->width * img->height;
+  return 1;
+}
+
+/// Blur an image with several filter sizes at once.
+/// On success, returns nonzero and sets out[0..n-1].
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageBlurMulti(Image img, int n, const int dx[], const int dy[],
+                   Image out[]) { ///
+  assert(img != NULL);
+  assert(n >= 0);
+  for (int k = 0; k < n; k++)
+    assert(dx[k] >= 0 && dy[k] >= 0);
+
+  IntegralImage ii = IntegralImageCreate(img, 0);
+  int success = ii != NULL;
+  for (int k = 0; k < n; k++)
+    out[k] = NULL;
+  for (int k = 0; success && k < n; k++)
+    success = (out[k] = imageNew(img->width, img->height, img->maxval, 0)) !=
+              NULL;
+  if (!success) {
+    errsave = errno;
+    for (int k = 0; k < n; k++)
+      ImageDestroy(&out[k]);
+    IntegralImageDestroy(&ii);
+    errno = errsave;
+    return 0;
+  }
+
+  // Fused sweep: row y of every output only reads rows y-dy..y+dy+1 of
+  // the table, so consecutive rows of all outputs reuse cached table rows.
+  for (int y = 0; y < img->height; y++) {
+    for (int k = 0; k < n; k++)
+      blurRow(ii, y, dx[k], dy[k], out[k]->pixel + (size_t)y * img->width);
+  }
+  PIXMEM += (unsigned long)n * img->width * img->height;
+  IntegralImageDestroy(&ii);
+  return 1;
+}
+
+/// Band histograms
+
+// Rows per band
+#define HIST_BAND 32
+
+// Internal structure for band histograms
+struct bandHistogram {
+  int width, height;
+  int nbands;
+  uint32_t (*band)[256]; // histogram of each band of HIST_BAND rows
+  uint32_t total[256];   // their sum
+};
+
+// Recount band b of img into bh, and update the total.
+static void bandCount(BandHistogram bh, Image img, int b) {
+  int y0 = b * HIST_BAND;
+  int y1 = y0 + HIST_BAND < img->height ? y0 + HIST_BAND : img->height;
+  uint32_t *band = bh->band[b];
+  for (int l = 0; l < 256; l++)
+    bh->total[l] -= band[l];
+  histogram(img->pixel + (size_t)y0 * img->width,
+            (size_t)(y1 - y0) * img->width, band);
+  for (int l = 0; l < 256; l++)
+    bh->total[l] += band[l];
+}
+
+/// Create the band histogram of img.
+BandHistogram BandHistogramCreate(Image img) { ///
+  assert(img != NULL);
+  int nbands = (img->height + HIST_BAND - 1) / HIST_BAND;
+  BandHistogram bh = malloc(sizeof(struct bandHistogram));
+  if (bh != NULL)
+    bh->band = calloc(nbands > 0 ? nbands : 1, sizeof(bh->band[0]));
+  if (!check(bh != NULL && bh->band != NULL, "Out of memory")) {
+    free(bh);
+    errno = ENOMEM;
+    return NULL;
+  }
+  bh->width = img->width;
+  bh->height = img->height;
+  bh->nbands = nbands;
+  memset(bh->total, 0, sizeof(bh->total));
+  for (int b = 0; b < nbands; b++)
+    bandCount(bh, img, b);
+  return bh;
+}
+
+/// Destroy the band histogram pointed to by (*bhp).
+void BandHistogramDestroy(BandHistogram *bhp) { ///
+  assert(bhp != NULL);
+  if (*bhp == NULL)
+    return;
+  free((*bhp)->band);
+  free(*bhp);
+  *bhp = NULL;
+}
+
+/// Bring the band histogram of img up to date, after img was changed.
+void BandHistogramUpdate(BandHistogram bh, Image img) { ///
+  assert(bh != NULL && img != NULL);
+  assert(bh->width == img->width && bh->height == img->height);
+  // A band is recounted once, however many dirty rectangles it meets.
+  int b = 0;
+  while (b < bh->nbands) {
+    int next = bh->nbands; // first band after b that meets a rectangle
+    int hit = 0;
+    for (int i = 0; i < img->ndirty; i++) {
+      int b0 = img->dirty[i][1] / HIST_BAND;
+      int b1 = (img->dirty[i][3] - 1) / HIST_BAND;
+      if (b0 <= b && b <= b1)
+        hit = 1;
+      else if (b0 > b && b0 < next)
+        next = b0;
+    }
+    if (hit) {
+      bandCount(bh, img, b);
+      b++;
+    } else {
+      b = next;
+    }
+  }
+}
+
+/// Get the histogram kept in bh.
+void BandHistogramGet(BandHistogram bh, uint32_t hist[256]) { ///
+  assert(bh != NULL && hist != NULL);
+  memcpy(hist, bh->total, sizeof(bh->total));
+}
+
+/// Approximate matching
+
+// Sum of absolute differences of n bytes (psadbw, when available).
+static inline uint64_t rowSAD(const uint8 *a, const uint8 *b, int n) {
+  uint64_t sum = 0;
+  int i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+  }
+  sum = (uint64_t)_mm_cvtsi128_si32(acc) +
+        (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+  for (; i < n; i++)
+    sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+  return sum;
+}
+
+// Dot product of n bytes (pmaddwd on zero-extended bytes, when available).
+static inline uint64_t rowDot(const uint8 *a, const uint8 *b, int n) {
+  uint64_t sum = 0;
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  while (i + 16 <= n) {
+    // 32-bit lanes receive at most 4*255*255 per step: flush periodically
+    int end = n - i > 0x10000 ? i + 0x10000 : n;
+    __m128i acc = zero;
+    for (; i + 16 <= end; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(va, zero),
+                                              _mm_unpacklo_epi8(vb, zero)));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(va, zero),
+                                              _mm_unpackhi_epi8(vb, zero)));
+    }
+    uint32_t lane[4];
+    _mm_storeu_si128((__m128i *)lane, acc);
+    sum += (uint64_t)lane[0] + lane[1] + lane[2] + lane[3];
+  }
+#endif
+  for (; i < n; i++)
+    sum += (uint64_t)a[i] * b[i];
+  return sum;
+}
+
+// In-place iterative radix-2 FFT of n complex values (n a power of 2),
+// stored as interleaved (re, im) pairs with stride 1.
+// inverse selects the sign of the exponent; no 1/n scaling is applied.
+static void fft(double *z, int n, int inverse) {
+  // bit-reversal permutation
+  for (int i = 1, j = 0; i < n; i++) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j |= bit;
+    if (i < j) {
+      double t = z[2 * i];
+      z[2 * i] = z[2 * j];
+      z[2 * j] = t;
+      t = z[2 * i + 1];
+      z[2 * i + 1] = z[2 * j + 1];
+      z[2 * j + 1] = t;
+    }
+  }
+  for (int len = 2; len <= n; len <<= 1) {
+    double ang = (inverse ? 2.0 : -2.0) * M_PI / len;
+    double wr = cos(ang);
+    double wi = sin(ang);
+    for (int i = 0; i < n; i += len) {
+      double cr = 1.0;
+      double ci = 0.0;
+      for (int k = 0; k < len / 2; k++) {
+        double *u = z + 2 * (i + k);
+        double *v = z + 2 * (i + k + len / 2);
+        double vr = v[0] * cr - v[1] * ci;
+        double vi = v[0] * ci + v[1] * cr;
+        v[0] = u[0] - vr;
+        v[1] = u[1] - vi;
+        u[0] += vr;
+        u[1] += vi;
+        double t = cr * wr - ci * wi;
+        ci = cr * wi + ci * wr;
+        cr = t;
+      }
+    }
+  }
+}
+
+// In-place 2D FFT of a q x p complex array (rows of p values).
+// Columns are copied to the scratch buffer col (2*q doubles) and back.
+static void fft2(double *z, int p, int q, int inverse, double *col) {
+  for (int y = 0; y < q; y++)
+    fft(z + 2 * (size_t)y * p, p, inverse);
+  for (int x = 0; x < p; x++) {
+    for (int y = 0; y < q; y++) {
+      col[2 * y] = z[2 * ((size_t)y * p + x)];
+      col[2 * y + 1] = z[2 * ((size_t)y * p + x) + 1];
+    }
+    fft(col, q, inverse);
+    for (int y = 0; y < q; y++) {
+      z[2 * ((size_t)y * p + x)] = col[2 * y];
+      z[2 * ((size_t)y * p + x) + 1] = col[2 * y + 1];
+    }
+  }
+}
+
+// Smallest power of 2 >= n.
+static int pow2ceil(int n) {
+  int p = 1;
+  while (p < n)
+    p *= 2;
+  return p;
+}
+
+// Cross-correlation of img2 with every subimage of img1 by FFT.
+// On success, cross[y*nx + x] = sum of img1(x+i, y+j)*img2(i, j),
+// for 0 <= x < nx = W1-W2+1, 0 <= y < ny = H1-H2+1.
+//
+// Both real images are packed into a single complex transform
+// z = img1 + i*img2, and their spectra are separated using the
+// conjugate symmetry of real signals.  The images are only zero-padded
+// to powers of 2 >= the size of img1: the circular wrap-around never
+// reaches valid positions.
+static int crossFFT(Image img1, Image img2, uint64_t *cross) {
+  int p = pow2ceil(img1->width);
+  int q = pow2ceil(img1->height);
+  int nx = img1->width - img2->width + 1;
+  int ny = img1->height - img2->height + 1;
+  double *z = calloc(2 * (size_t)p * q, sizeof(double));
+  double *col = malloc(2 * (size_t)q * sizeof(double));
+  if (!check(z != NULL && col != NULL, "Out of memory")) {
+    free(z);
+    free(col);
+    errno = ENOMEM;
+    return 0;
+  }
+  for (int y = 0; y < img1->height; y++) {
+    for (int x = 0; x < img1->width; x++)
+      z[2 * ((size_t)y * p + x)] = img1->pixel[y * img1->width + x];
+  }
+  for (int y = 0; y < img2->height; y++) {
+    for (int x = 0; x < img2->width; x++)
+      z[2 * ((size_t)y * p + x) + 1] = img2->pixel[y * img2->width + x];
+  }
+  PIXMEM += (unsigned long)(img1->width * img1->height +
+                            img2->width * img2->height);
+  fft2(z, p, q, 0, col);
+
+  // Z1(k) = (Z(k) + conj(Z(-k)))/2,  Z2(k) = (Z(k) - conj(Z(-k)))/(2i).
+  // Correlation spectrum is Z1(k)*conj(Z2(k)); each pair (k, -k) is done
+  // together, because both entries are overwritten.
+  for (int v = 0; v < q; v++) {
+    for (int u = 0; u < p; u++) {
+      size_t k = (size_t)v * p + u;
+      size_t m = (size_t)((q - v) % q) * p + (p - u) % p;
+      if (m < k)
+        continue;
+      double ar = z[2 * k], ai = z[2 * k + 1];
+      double br = z[2 * m], bi = z[2 * m + 1];
+      // spectra at k
+      double r1 = (ar + br) / 2, i1 = (ai - bi) / 2;
+      double r2 = (ai + bi) / 2, i2 = (br - ar) / 2;
+      z[2 * k] = r1 * r2 + i1 * i2;
+      z[2 * k + 1] = i1 * r2 - r1 * i2;
+      // spectra at m = -k are the conjugates of those at k
+      z[2 * m] = z[2 * k];
+      z[2 * m + 1] = -z[2 * k + 1];
+    }
+  }
+  fft2(z, p, q, 1, col);
+
+  double scale = 1.0 / ((double)p * q);
+  for (int y = 0; y < ny; y++) {
+    for (int x = 0; x < nx; x++) {
+      double c = z[2 * ((size_t)y * p + x)] * scale;
+      cross[(size_t)y * nx + x] = c > 0.0 ? (uint64_t)(c + 0.5) : 0;
+    }
+  }
+  free(z);
+  free(col);
+  return 1;
+}
+
+// Rough relative costs, in the same (arbitrary) unit, of one SIMD
+// multiply-accumulate per pixel pair and of one FFT butterfly per element
+// and level.  Measured on x86-64 with SSE2; only the ratio matters.
+#define COST_DIRECT_PIXEL 0.125
+#define COST_FFT_ELEMENT 1.5
+
+/// Locate the best approximate match of a subimage inside another image.
+/// On success, returns nonzero, and sets (*px, *py) and *score.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageLocateBestMatch(Image img1, int *px, int *py, Image img2,
+                         MatchMetric metric, double *score) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidRect(img1, 0, 0, img2->width, img2->height));
+  assert(metric == MATCH_SAD || metric == MATCH_SSD || metric == MATCH_NCC);
+
+  int width1 = img1->width;
+  int w = img2->width;
+  int h = img2->height;
+  int nx = img1->width - w + 1;
+  int ny = img1->height - h + 1;
+  double n = (double)w * h;
+
+  if (metric == MATCH_SAD) {
+    // Direct, with early termination when the partial sum can no longer
+    // beat the best so far (ties keep the first position).
+    uint64_t best = UINT64_MAX;
+    for (int y = 0; y < ny; y++) {
+      for (int x = 0; x < nx; x++) {
+        ILSI_ITS += 1;
+        uint64_t sad = 0;
+        for (int j = 0; j < h && sad < best; j++) {
+          sad += rowSAD(img1->pixel + (y + j) * width1 + x,
+                        img2->pixel + j * w, w);
+          PIXMEM += 2 * (unsigned long)w;
+        }
+        if (sad < best) {
+          best = sad;
+          *px = x;
+          *py = y;
+        }
+      }
+    }
+    *score = (double)best;
+    return 1;
+  }
+
+  // SSD and NCC only depend on window sums (from summed-area tables) and
+  // on the cross-correlation, which is computed directly or by FFT.
+  uint64_t *cross = malloc((size_t)nx * ny * sizeof(uint64_t));
+  if (!check(cross != NULL, "Out of memory")) {
+    errno = ENOMEM;
+    return 0;
+  }
+  IntegralImage ii = IntegralImageCreate(img1, 1);
+  if (ii == NULL) {
+    free(cross);
+    return 0;
+  }
+
+  double p = pow2ceil(img1->width);
+  double q = pow2ceil(img1->height);
+  double costDirect = COST_DIRECT_PIXEL * nx * ny * n;
+  double costFFT = COST_FFT_ELEMENT * 2.0 * p * q * log2(p * q);
+  int success = 1;
+  if (costFFT < costDirect) {
+    success = crossFFT(img1, img2, cross);
+  } else {
+    for (int y = 0; y < ny; y++) {
+      for (int x = 0; x < nx; x++) {
+        uint64_t c = 0;
+        for (int j = 0; j < h; j++) {
+          c += rowDot(img1->pixel + (y + j) * width1 + x,
+                      img2->pixel + j * w, w);
+        }
+        PIXMEM += 2 * (unsigned long)(w * h);
+        cross[(size_t)y * nx + x] = c;
+      }
+    }
+  }
+
+  if (success) {
+    double sumT = 0.0;
+    double sqT = 0.0;
+    for (int i = 0; i < w * h; i++) {
+      sumT += img2->pixel[i];
+      sqT += (double)img2->pixel[i] * img2->pixel[i];
+    }
+    PIXMEM += (unsigned long)(w * h);
+    double varT = n * sqT - sumT * sumT; // n^2 times the variance
+
+    int first = 1;
+    double best = 0.0;
+    for (int y = 0; y < ny; y++) {
+      for (int x = 0; x < nx; x++) {
+        ILSI_ITS += 1;
+        double c = (double)cross[(size_t)y * nx + x];
+        double sumI = (double)IntegralImageRectSum(ii, x, y, w, h);
+        double sqI = (double)IntegralImageRectSumSq(ii, x, y, w, h);
+        double s;
+        int better;
+        if (metric == MATCH_SSD) {
+          s = sqI - 2.0 * c + sqT;
+          better = s < best;
+        } else {
+          double varI = n * sqI - sumI * sumI;
+          if (varI == 0.0 || varT == 0.0) {
+            s = (varI == 0.0 && varT == 0.0) ? 1.0 : 0.0;
+          } else {
+            s = (n * c - sumI * sumT) / sqrt(varI * varT);
+          }
+          better = s > best;
+        }
+        if (first || better) {
+          first = 0;
+          best = s;
+          *px = x;
+          *py = y;
+        }
+      }
+    }
+    *score = best;
+  }
+
+  free(cross);
+  IntegralImageDestroy(&ii);
+  return success;
+}
+
+/// Orientation-invariant search
+
+// Check if img2 matches the subimage of img1 at (x, y), row by row.
+static int matchRows(Image img1, int x, int y, Image img2) {
+  int j = 0;
+  while (j < img2->height &&
+         memcmp(img1->pixel + (y + j) * img1->width + x,
+                img2->pixel + j * img2->width, img2->width) == 0)
+    j++;
+  PIXMEM += 2 * (unsigned long)((j + (j < img2->height)) * img2->width);
+  return j == img2->height;
+}
+
+/// Locate a subimage inside another image, in any of 8 orientations.
+/// If a match is found, returns 1 and sets (*px, *py, *po).
+/// If no match is found, returns 0 and (*px, *py, *po) are left untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateSubImageOriented(Image img1, int *px, int *py, int *po,
+                                Image img2) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+
+  // The 8 oriented versions of img2 (t[0] is img2 itself).
+  Image t[8] = {img2};
+  int success = (t[4] = ImageMirror(img2)) != NULL;
+  for (int o = 1; success && o < 8; o++) {
+    if (o != 4)
+      success = (t[o] = ImageRotate(t[o - 1])) != NULL;
+  }
+  IntegralImage ii = NULL;
+  success = success && (ii = IntegralImageCreate(img1, 0)) != NULL;
+  if (!success) {
+    errsave = errno;
+    for (int o = 1; o < 8; o++) {
+      if (t[o] != NULL)
+        ImageDestroy(&t[o]);
+    }
+    errno = errsave;
+    return -1;
+  }
+
+  // Orientations worth searching: those that fit, without repetitions
+  // (symmetric subimages look the same in several orientations).
+  int active[8];
+  int nactive = 0;
+  for (int o = 0; o < 8; o++) {
+    if (!ImageValidRect(img1, 0, 0, t[o]->width, t[o]->height))
+      continue;
+    int dup = 0;
+    for (int i = 0; i < nactive && !dup; i++) {
+      Image u = t[active[i]];
+      dup = u->width == t[o]->width && u->height == t[o]->height &&
+            memcmp(u->pixel, t[o]->pixel, u->width * u->height) == 0;
+    }
+    if (!dup)
+      active[nactive++] = o;
+  }
+
+  // All orientations have the same sum of pixel levels, so a single window
+  // sum per shape (w x h, or h x w) rejects most positions for all of them.
+  uint64_t target = 0;
+  for (int i = 0; i < img2->width * img2->height; i++)
+    target += img2->pixel[i];
+  PIXMEM += (unsigned long)(img2->width * img2->height);
+
+  int found = 0;
+  for (int y = 0; !found && y < img1->height; y++) {
+    for (int x = 0; !found && x < img1->width; x++) {
+      int sumOK[2] = {-1, -1}; // per shape: unknown, no, yes
+      for (int i = 0; !found && i < nactive; i++) {
+        Image u = t[active[i]];
+        int shape = active[i] % 2; // odd rotations swap width and height
+        if (!ImageValidRect(img1, x, y, u->width, u->height))
+          continue;
+        ILSI_ITS += 1;
+        if (sumOK[shape] < 0) {
+          sumOK[shape] = IntegralImageRectSum(ii, x, y, u->width,
+                                              u->height) == target;
+        }
+        if (sumOK[shape] && matchRows(img1, x, y, u)) {
+          found = 1;
+          *px = x;
+          *py = y;
+          *po = active[i];
+        }
+      }
+    }
+  }
+
+  for (int o = 1; o < 8; o++)
+    ImageDestroy(&t[o]);
+  IntegralImageDestroy(&ii);
+  return found;
+}
+
+/// Image pyramids
+
+// Maximum number of levels in a pyramid (way beyond any practical image).
+#define PYR_MAXLEVELS 24
+
+// Minimum dimension of a level, when levels are chosen automatically.
+#define PYR_MINDIM 8
+
+// Minimum dimension of the subimage at the coarsest level searched.
+#define PYR_MINSUB 16
+
+// Default number of candidates kept per level.
+#define PYR_CANDIDATES 16
+
+// Internal structure for image pyramids
+struct imagePyramid {
+  int levels;
+  Image level[PYR_MAXLEVELS]; // level[0] is not owned by the pyramid
+};
+
+// Create a 2x box-downsampled version of img (odd last row/column dropped).
+static Image downsample(Image img) {
+  int w = img->width / 2;
+  int h = img->height / 2;
+  Image small = imageNew(w, h, img->maxval, 0);
+  if (small == NULL)
+    return NULL;
+  for (int y = 0; y < h; y++) {
+    const uint8 *r0 = img->pixel + (2 * y) * img->width;
+    const uint8 *r1 = r0 + img->width;
+    uint8 *out = small->pixel + y * w;
+    for (int x = 0; x < w; x++) {
+      out[x] = (uint8)((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] +
+                        r1[2 * x + 1] + 2) / 4);
+    }
+  }
+  PIXMEM += (unsigned long)(5 * w * h); // 4 reads + 1 write per pixel
+  return small;
+}
+
+/// Create an image pyramid for img.
+/// On success, a new pyramid is returned.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImagePyramid ImagePyramidCreate(Image img, int levels) { ///
+  assert(img != NULL);
+  assert(levels <= PYR_MAXLEVELS);
+
+  ImagePyramid pyr = malloc(sizeof(struct imagePyramid));
+  if (!check(pyr != NULL, "Out of memory")) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  pyr->level[0] = img;
+  pyr->levels = 1;
+  while (levels > 0 ? pyr->levels < levels
+                    : pyr->levels < PYR_MAXLEVELS &&
+                          pyr->level[pyr->levels - 1]->width >=
+                              2 * PYR_MINDIM &&
+                          pyr->level[pyr->levels - 1]->height >=
+                              2 * PYR_MINDIM) {
+    Image next = downsample(pyr->level[pyr->levels - 1]);
+    if (next == NULL) {
+      errsave = errno;
+      ImagePyramidDestroy(&pyr);
+      errno = errsave;
+      return NULL;
+    }
+    pyr->level[pyr->levels++] = next;
+  }
+  return pyr;
+}
+
+/// Destroy the pyramid pointed to by (*pyrp).
+/// The level 0 image is not destroyed.
+void ImagePyramidDestroy(ImagePyramid *pyrp) { ///
+  assert(pyrp != NULL);
+  if (*pyrp == NULL)
+    return;
+  for (int l = 1; l < (*pyrp)->levels; l++)
+    ImageDestroy(&(*pyrp)->level[l]);
+  free(*pyrp);
+  *pyrp = NULL;
+}
+
+/// Get the number of levels in pyramid.
+int ImagePyramidLevels(ImagePyramid pyr) { ///
+  assert(pyr != NULL);
+  return pyr->levels;
+}
+
+// A candidate match position, and its cost (SAD) at some level.
+struct candidate {
+  int x;
+  int y;
+  uint64_t cost;
+};
+
+// Insert (x, y, cost) in list cand[0..*n-1] of the best k candidates,
+// which is kept sorted by increasing cost (ties in insertion order).
+// Candidates are kept at least 2 positions apart (non-maximum suppression),
+// so that the k slots cover k distinct regions.
+static void keepBest(struct candidate *cand, int *n, int k, int x, int y,
+                     uint64_t cost) {
+  if (*n == k && cost >= cand[k - 1].cost)
+    return;
+  int i;
+  for (i = 0; i < *n; i++) {
+    if (abs(cand[i].x - x) <= 1 && abs(cand[i].y - y) <= 1)
+      break;
+  }
+  if (i < *n) {
+    if (cand[i].cost <= cost)
+      return; // a better neighbour is already kept
+    // replace the worse neighbour: remove it from the list
+    for (; i + 1 < *n; i++)
+      cand[i] = cand[i + 1];
+    (*n)--;
+  }
+  i = *n < k ? (*n)++ : k - 1;
+  for (; i > 0 && cand[i - 1].cost > cost; i--)
+    cand[i] = cand[i - 1];
+  cand[i].x = x;
+  cand[i].y = y;
+  cand[i].cost = cost;
+}
+
+// SAD between img2 and the subimage of img1 at (x, y).
+static uint64_t subImageSAD(Image img1, int x, int y, Image img2) {
+  uint64_t sad = 0;
+  for (int j = 0; j < img2->height; j++) {
+    sad += rowSAD(img1->pixel + (y + j) * img1->width + x,
+                  img2->pixel + j * img2->width, img2->width);
+  }
+  PIXMEM += 2 * (unsigned long)(img2->width * img2->height);
+  return sad;
+}
+
+/// Locate a subimage inside an image, using its pyramid.
+/// If a match is found, returns 1 and sets (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImagePyramidLocate(ImagePyramid pyr, int *px, int *py, Image img2,
+                       uint8 tol, int k) { ///
+  assert(pyr != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidRect(pyr->level[0], 0, 0, img2->width, img2->height));
+  if (k <= 0)
+    k = PYR_CANDIDATES;
+
+  // Pyramid of img2, only as deep as useful.
+  Image sub[PYR_MAXLEVELS];
+  sub[0] = img2;
+  int top = 0;
+  int success = 1;
+  while (success && top + 1 < pyr->levels &&
+         sub[top]->width >= 2 * PYR_MINSUB &&
+         sub[top]->height >= 2 * PYR_MINSUB) {
+    sub[top + 1] = downsample(sub[top]);
+    success = sub[top + 1] != NULL;
+    top += success;
+  }
+  // candidates for current level, and for the next (finer) level
+  struct candidate *cand = malloc(k * sizeof(struct candidate));
+  struct candidate *next = malloc(k * sizeof(struct candidate));
+  if (!check(success && cand != NULL && next != NULL, "Out of memory")) {
+    for (int l = 1; l <= top; l++)
+      ImageDestroy(&sub[l]);
+    free(cand);
+    free(next);
+    errno = ENOMEM;
+    return -1;
+  }
+  int found = 0;
+  Image big = pyr->level[top];
+  if (top == 0) {
+    // img2 too small for a pyramid search: verify every position
+    for (int y = 0; !found && y + img2->height <= big->height; y++) {
+      for (int x = 0; !found && x + img2->width <= big->width; x++) {
+        if (ImageMatchSubImageTol(big, x, y, img2, tol)) {
+          found = 1;
+          *px = x;
+          *py = y;
+        }
+      }
+    }
+  }
+
+  // Exhaustive SAD search at the coarsest level.
+  int ncand = 0;
+  for (int y = 0; top > 0 && y + sub[top]->height <= big->height; y++) {
+    for (int x = 0; x + sub[top]->width <= big->width; x++) {
+      ILSI_ITS += 1;
+      keepBest(cand, &ncand, k, x, y, subImageSAD(big, x, y, sub[top]));
+    }
+  }
+
+  // Refine: a match at (x, y) on level l+1 maps near (2x, 2y) on level l,
+  // but may be off by one, due to rounding and to block misalignment,
+  // plus one more for suppressed neighbours of (x, y).
+  for (int l = top - 1; l >= 0; l--) {
+    big = pyr->level[l];
+    int nnext = 0;
+    for (int c = 0; c < ncand; c++) {
+      for (int y = 2 * cand[c].y - 2; y <= 2 * cand[c].y + 3; y++) {
+        for (int x = 2 * cand[c].x - 2; x <= 2 * cand[c].x + 3; x++) {
+          if (!ImageValidRect(big, x, y, sub[l]->width, sub[l]->height))
+            continue;
+          if (l > 0) {
+            ILSI_ITS += 1;
+            keepBest(next, &nnext, k, x, y, subImageSAD(big, x, y, sub[l]));
+          } else if ((!found || y < *py || (y == *py && x < *px)) &&
+                     ImageMatchSubImageTol(big, x, y, img2, tol)) {
+            found = 1;
+            *px = x;
+            *py = y;
+          }
+        }
+      }
+    }
+    struct candidate *t = cand;
+    cand = next;
+    next = t;
+    ncand = nnext;
+  }
+
+  for (int l = 1; l <= top; l++)
+    ImageDestroy(&sub[l]);
+  free(cand);
+  free(next);
+  return found;
+}
+
+/// Block-hash indexes
+
+// Block hashes are 2D Rabin-Karp hashes (mod 2^64):
+//   row hash   r(x, y) = sum_i p(x+i, y) * HASH_BX^(bw-1-i),  0 <= i < bw
+//   block hash b(x, y) = sum_j r(x, y+j) * HASH_BY^(bh-1-j),  0 <= j < bh
+// so both can be rolled along x and y in O(1) per position.
+#define HASH_BX 0x100000001B3ull
+#define HASH_BY 0x9E3779B97F4A7C15ull
+
+// Magic number and version in index files.
+#define INDEX_MAGIC 0x58423849u // "I8BX" in little-endian
+#define INDEX_VERSION 1u
+
+// Blocks of the subimage looked up per query: up to this many per row and
+// per column.
+#define INDEX_SAMPLES 4
+
+// Hint the processor to fetch *p into cache (no-op where unsupported).
+// Table accesses are random, so fetching a few positions ahead hides most
+// of the cache miss latency while building an index.
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void)0)
+#endif
+#define PREFETCH_AHEAD 16
+
+// An entry of the index hash table: the positions of the blocks with a
+// given hash are pos[start .. start+count-1].  Empty entries have count 0.
+struct indexEntry {
+  uint64_t key;
+  uint32_t start;
+  uint32_t count;
+};
+
+// Internal structure for block-hash indexes
+struct imageIndex {
+  Image img;                 // indexed image (not owned)
+  int bw;                    // block width
+  int bh;                    // block height
+  uint32_t mask;             // table capacity - 1 (capacity is a power of 2)
+  uint32_t used;             // number of non-empty table entries
+  struct indexEntry *table;  // open-addressing hash table
+  uint32_t *pos;             // block positions (y*width + x), grouped by hash
+  uint32_t npos;             // number of block positions
+};
+
+// Spread the bits of a block hash over the table index bits.
+static inline uint32_t indexSlot(uint64_t key, uint32_t mask) {
+  key ^= key >> 33;
+  key *= 0xFF51AFD7ED558CCDull;
+  key ^= key >> 33;
+  return (uint32_t)key & mask;
+}
+
+// Get the table entry for key: either the one holding key, or the empty
+// entry where it should be inserted.
+static struct indexEntry *indexFind(ImageIndex idx, uint64_t key) {
+  uint32_t i = indexSlot(key, idx->mask);
+  while (idx->table[i].count != 0 && idx->table[i].key != key)
+    i = (i + 1) & idx->mask;
+  return &idx->table[i];
+}
+
+// Double the capacity of the table.  Returns 0 on allocation failure.
+static int indexGrow(ImageIndex idx) {
+  struct indexEntry *old = idx->table;
+  uint32_t oldcap = idx->mask + 1;
+  idx->table = calloc(2 * (size_t)oldcap, sizeof(struct indexEntry));
+  if (!check(idx->table != NULL, "Out of memory")) {
+    idx->table = old;
+    errno = ENOMEM;
+    return 0;
+  }
+  idx->mask = 2 * oldcap - 1;
+  for (uint32_t i = 0; i < oldcap; i++) {
+    if (old[i].count != 0)
+      *indexFind(idx, old[i].key) = old[i];
+  }
+  free(old);
+  return 1;
+}
+
+// Rolling computation of block hashes, one row of block positions at a time.
+struct blockHasher {
+  Image img;
+  int bw;
+  int bh;
+  int nx;         // block positions per row
+  int y;          // next row of block positions
+  uint64_t powx;  // HASH_BX^(bw-1)
+  uint64_t powy;  // HASH_BY^(bh-1)
+  uint64_t *rows; // row hashes of the last bh image rows (circular)
+  uint64_t *hash; // block hashes of current row of block positions
+};
+
+// Compute the row hashes of image row y into out[0..nx-1].
+static void rowHashes(struct blockHasher *bh, int y, uint64_t *out) {
+  const uint8 *p = bh->img->pixel + y * bh->img->width;
+  uint64_t r = 0;
+  for (int i = 0; i < bh->bw; i++)
+    r = r * HASH_BX + p[i];
+  out[0] = r;
+  for (int x = 1; x < bh->nx; x++) {
+    r = (r - p[x - 1] * bh->powx) * HASH_BX + p[x - 1 + bh->bw];
+    out[x] = r;
+  }
+  PIXMEM += (unsigned long)bh->img->width;
+}
+
+static void hasherFree(struct blockHasher *bh) {
+  free(bh->rows);
+  free(bh->hash);
+}
+
+// Prepare to hash the bw x bh blocks of img.  Returns 0 on failure.
+static int hasherInit(struct blockHasher *bh, Image img, int bw, int bhgt) {
+  bh->img = img;
+  bh->bw = bw;
+  bh->bh = bhgt;
+  bh->nx = img->width - bw + 1;
+  bh->y = 0;
+  bh->powx = 1;
+  for (int i = 1; i < bw; i++)
+    bh->powx *= HASH_BX;
+  bh->powy = 1;
+  for (int j = 1; j < bhgt; j++)
+    bh->powy *= HASH_BY;
+  bh->rows = malloc((size_t)bhgt * bh->nx * sizeof(uint64_t));
+  bh->hash = malloc((size_t)bh->nx * sizeof(uint64_t));
+  if (!check(bh->rows != NULL && bh->hash != NULL, "Out of memory")) {
+    hasherFree(bh);
+    bh->rows = bh->hash = NULL;
+    errno = ENOMEM;
+    return 0;
+  }
+  return 1;
+}
+
+// Get the block hashes of the next row of block positions.
+// Requires: there is a next row (y <= height - bh).
+static const uint64_t *hasherNext(struct blockHasher *bh) {
+  int nx = bh->nx;
+  if (bh->y == 0) {
+    for (int x = 0; x < nx; x++)
+      bh->hash[x] = 0;
+    for (int j = 0; j < bh->bh; j++) {
+      uint64_t *r = bh->rows + (size_t)j * nx;
+      rowHashes(bh, j, r);
+      for (int x = 0; x < nx; x++)
+        bh->hash[x] = bh->hash[x] * HASH_BY + r[x];
+    }
+  } else {
+    // drop image row y-1, add image row y-1+bh (same slot in the ring)
+    uint64_t *r = bh->rows + (size_t)((bh->y - 1) % bh->bh) * nx;
+    for (int x = 0; x < nx; x++)
+      bh->hash[x] -= r[x] * bh->powy;
+    rowHashes(bh, bh->y - 1 + bh->bh, r);
+    for (int x = 0; x < nx; x++)
+      bh->hash[x] = bh->hash[x] * HASH_BY + r[x];
+  }
+  bh->y++;
+  return bh->hash;
+}
+
+// Hash of the bw x bh block of img at (x, y), computed directly.
+static uint64_t blockHash(Image img, int x, int y, int bw, int bh) {
+  uint64_t b = 0;
+  for (int j = 0; j < bh; j++) {
+    const uint8 *p = img->pixel + (y + j) * img->width + x;
+    uint64_t r = 0;
+    for (int i = 0; i < bw; i++)
+      r = r * HASH_BX + p[i];
+    b = b * HASH_BY + r;
+  }
+  PIXMEM += (unsigned long)(bw * bh);
+  return b;
+}
+
+// Fingerprint of image contents, to validate index files.
+static uint64_t imageFingerprint(Image img) {
+  uint64_t f = 0xCBF29CE484222325ull; // FNV-1a
+  int size = img->width * img->height;
+  for (int i = 0; i < size; i++)
+    f = (f ^ img->pixel[i]) * HASH_BX;
+  PIXMEM += (unsigned long)size;
+  return f ^ ((uint64_t)img->width << 32 | (uint32_t)img->height);
+}
+
+// Allocate an empty index structure.  Returns NULL on failure.
+static ImageIndex indexAlloc(Image img, int bw, int bh, uint32_t capacity) {
+  ImageIndex idx = malloc(sizeof(struct imageIndex));
+  if (idx != NULL) {
+    idx->img = img;
+    idx->bw = bw;
+    idx->bh = bh;
+    idx->npos = (uint32_t)(img->width - bw + 1) * (img->height - bh + 1);
+    idx->mask = capacity - 1;
+    idx->used = 0;
+    idx->table = calloc(capacity, sizeof(struct indexEntry));
+    idx->pos = malloc((idx->npos > 0 ? idx->npos : 1) * sizeof(uint32_t));
+  }
+  if (!check(idx != NULL && idx->table != NULL && idx->pos != NULL,
+             "Out of memory")) {
+    ImageIndexDestroy(&idx);
+    errno = ENOMEM;
+  }
+  return idx;
+}
+
+/// Create a block-hash index for img.
+/// On success, a new index is returned.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexCreate(Image img, int bw, int bh) { ///
+  assert(img != NULL);
+  assert(1 <= bw && bw <= img->width);
+  assert(1 <= bh && bh <= img->height);
+
+  int nx = img->width - bw + 1;
+  int ny = img->height - bh + 1;
+  // Start with room for 1/8 of the positions having distinct hashes:
+  // repetitive images need no more, and others need only 3 doublings.
+  uint32_t capacity = 1024;
+  while (capacity < (uint32_t)nx * ny / 4)
+    capacity *= 2;
+  ImageIndex idx = indexAlloc(img, bw, bh, capacity);
+  if (idx == NULL)
+    return NULL;
+
+  // Two passes over the block hashes, in raster order:
+  // the first counts the positions of each hash, the second stores them,
+  // so each hash gets its positions in raster order, without sorting.
+  struct blockHasher hasher;
+  int success = hasherInit(&hasher, img, bw, bh);
+  for (int y = 0; success && y < ny; y++) {
+    const uint64_t *hash = hasherNext(&hasher);
+    for (int x = 0; success && x < nx; x++) {
+      if (x + PREFETCH_AHEAD < nx)
+        PREFETCH(&idx->table[indexSlot(hash[x + PREFETCH_AHEAD], idx->mask)]);
+      struct indexEntry *e = indexFind(idx, hash[x]);
+      if (e->count == 0) {
+        e->key = hash[x];
+        idx->used++;
+      }
+      e->count++;
+      if (2 * idx->used > idx->mask)
+        success = indexGrow(idx); // keep load factor <= 1/2
+    }
+  }
+  if (success) {
+    // start is used as a fill pointer in the second pass, and rewound after
+    uint32_t start = 0;
+    for (uint32_t i = 0; i <= idx->mask; i++) {
+      idx->table[i].start = start;
+      start += idx->table[i].count;
+    }
+    hasher.y = 0;
+    for (int y = 0; y < ny; y++) {
+      const uint64_t *hash = hasherNext(&hasher);
+      for (int x = 0; x < nx; x++) {
+        if (x + PREFETCH_AHEAD < nx)
+          PREFETCH(
+              &idx->table[indexSlot(hash[x + PREFETCH_AHEAD], idx->mask)]);
+        struct indexEntry *e = indexFind(idx, hash[x]);
+        idx->pos[e->start++] = (uint32_t)(y * img->width + x);
+      }
+    }
+    for (uint32_t i = 0; i <= idx->mask; i++)
+      idx->table[i].start -= idx->table[i].count;
+  }
+  if (hasher.rows != NULL)
+    hasherFree(&hasher);
+  if (!success) {
+    errsave = errno;
+    ImageIndexDestroy(&idx);
+    errno = errsave;
+  }
+  return idx;
+}
+
+/// Destroy the index pointed to by (*idxp).
+/// The indexed image is not destroyed.
+void ImageIndexDestroy(ImageIndex *idxp) { ///
+  assert(idxp != NULL);
+  if (*idxp == NULL)
+    return;
+  free((*idxp)->table);
+  free((*idxp)->pos);
+  free(*idxp);
+  *idxp = NULL;
+}
+
+// Check that all positions stored in idx are valid.
+static int indexValid(ImageIndex idx) {
+  uint64_t total = 0;
+  for (uint32_t i = 0; i <= idx->mask; i++) {
+    if ((uint64_t)idx->table[i].start + idx->table[i].count > idx->npos)
+      return 0;
+    total += idx->table[i].count;
+  }
+  uint32_t size = (uint32_t)(idx->img->width * idx->img->height);
+  for (uint32_t i = 0; i < idx->npos; i++) {
+    if (idx->pos[i] >= size)
+      return 0;
+  }
+  return total == idx->npos;
+}
+
+/// Load an index of img from a file (written by ImageIndexSave).
+/// On success, a new index is returned.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexLoad(const char *filename, Image img) { ///
+  assert(img != NULL);
+  uint32_t head[9]; // magic, version, width, height, bw, bh, mask, npos, used
+  uint64_t fingerprint;
+  FILE *f = NULL;
+  ImageIndex idx = NULL;
+  struct indexEntry *entries = NULL;
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      check(fread(head, sizeof(uint32_t), 9, f) == 9 &&
+                fread(&fingerprint, sizeof(uint64_t), 1, f) == 1,
+            "Reading header") &&
+      check(head[0] == INDEX_MAGIC && head[1] == INDEX_VERSION,
+            "Invalid file format") &&
+      check(head[2] == (uint32_t)img->width &&
+                head[3] == (uint32_t)img->height && 1 <= head[4] &&
+                head[4] <= head[2] && 1 <= head[5] && head[5] <= head[3] &&
+                fingerprint == imageFingerprint(img),
+            "Index does not match image") &&
+      check(head[7] == (head[2] - head[4] + 1) * (head[3] - head[5] + 1),
+            "Invalid number of positions") &&
+      // No larger than ImageIndexCreate can grow it for npos positions
+      check(((head[6] + 1) & head[6]) == 0 && head[6] < UINT32_MAX / 2 &&
+                (uint64_t)head[6] < 4 * (uint64_t)(head[7] > 256 ? head[7]
+                                                                 : 256) &&
+                head[8] <= head[6] / 2 + 1,
+            "Invalid table size") &&
+      // Allocate index
+      (idx = indexAlloc(img, head[4], head[5], head[6] + 1)) != NULL &&
+      check((entries = malloc((head[8] + 1) * sizeof(struct indexEntry))) !=
+                NULL,
+            "Out of memory") &&
+      // Read non-empty table entries and positions
+      check(fread(entries, sizeof(struct indexEntry), head[8], f) ==
+                    head[8] &&
+                fread(idx->pos, sizeof(uint32_t), idx->npos, f) == idx->npos,
+            "Reading index");
+  if (success) {
+    for (uint32_t i = 0; i < head[8]; i++) {
+      struct indexEntry *e = indexFind(idx, entries[i].key);
+      success = success && e->count == 0 && entries[i].count != 0;
+      *e = entries[i];
+    }
+    idx->used = head[8];
+    success = check(success && indexValid(idx), "Invalid index");
+  }
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    ImageIndexDestroy(&idx);
+    errno = errsave;
+  }
+  free(entries);
+  if (f != NULL)
+    fclose(f);
+  return idx;
+}
+
+/// Save index to a file.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageIndexSave(ImageIndex idx, const char *filename) { ///
+  assert(idx != NULL);
+  uint32_t head[9] = {INDEX_MAGIC,
+                      INDEX_VERSION,
+                      (uint32_t)idx->img->width,
+                      (uint32_t)idx->img->height,
+                      (uint32_t)idx->bw,
+                      (uint32_t)idx->bh,
+                      idx->mask,
+                      idx->npos,
+                      idx->used};
+  uint64_t fingerprint = imageFingerprint(idx->img);
+  FILE *f = NULL;
+
+  int success =
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fwrite(head, sizeof(uint32_t), 9, f) == 9 &&
+                fwrite(&fingerprint, sizeof(uint64_t), 1, f) == 1,
+            "Writing header failed");
+  // only the non-empty table entries are written
+  for (uint32_t i = 0; success && i <= idx->mask; i++) {
+    if (idx->table[i].count != 0) {
+      success = check(fwrite(&idx->table[i], sizeof(struct indexEntry), 1,
+                             f) == 1,
+                      "Writing index failed");
+    }
+  }
+  success = success &&
+            check(fwrite(idx->pos, sizeof(uint32_t), idx->npos, f) ==
+                      idx->npos,
+                  "Writing index failed");
+
+  // Cleanup
+  if (f != NULL)
+    success = check(fclose(f) == 0, "Writing index failed") && success;
+  return success;
+}
+
+/// Locate a subimage inside the indexed image.
+/// If a match is found, returns 1 and sets (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int ImageIndexLocate(ImageIndex idx, int *px, int *py, Image img2) { ///
+  assert(idx != NULL);
+  assert(img2 != NULL);
+  Image img1 = idx->img;
+  assert(ImageValidRect(img1, 0, 0, img2->width, img2->height));
+  assert(img2->width >= idx->bw && img2->height >= idx->bh);
+
+  // Look up a few non-overlapping blocks of img2 (up to a 4x4 grid spread
+  // over img2), and keep the one with the fewest occurrences.
+  // Any block that does not occur at all means there is no match.
+  int gx = img2->width / idx->bw;  // blocks per row of img2
+  int gy = img2->height / idx->bh; // blocks per column of img2
+  int sx = gx < INDEX_SAMPLES ? gx : INDEX_SAMPLES;
+  int sy = gy < INDEX_SAMPLES ? gy : INDEX_SAMPLES;
+  struct indexEntry *best = NULL;
+  int bestx = 0;
+  int besty = 0;
+  for (int j = 0; j < sy && (best == NULL || best->count > 1); j++) {
+    for (int i = 0; i < sx && (best == NULL || best->count > 1); i++) {
+      int ox = (i * gx / sx) * idx->bw;
+      int oy = (j * gy / sy) * idx->bh;
+      struct indexEntry *e =
+          indexFind(idx, blockHash(img2, ox, oy, idx->bw, idx->bh));
+      if (e->count == 0)
+        return 0;
+      if (best == NULL || e->count < best->count) {
+        best = e;
+        bestx = ox;
+        besty = oy;
+      }
+    }
+  }
+
+  // Verify the candidate positions implied by that block.
+  // They come in raster order, so the first match is the first one that
+  // ImageLocateSubImage would find.
+  for (uint32_t i = best->start; i < best->start + best->count; i++) {
+    int x = (int)(idx->pos[i] % img1->width) - bestx;
+    int y = (int)(idx->pos[i] / img1->width) - besty;
+    ILSI_ITS += 1;
+    if (x < 0 || y < 0 ||
+        !ImageValidRect(img1, x, y, img2->width, img2->height))
+      continue;
+    int j = 0;
+    while (j < img2->height &&
+           memcmp(img1->pixel + (y + j) * img1->width + x,
+                  img2->pixel + j * img2->width, img2->width) == 0)
+      j++;
+    PIXMEM += 2 * (unsigned long)(j * img2->width);
+    if (j == img2->height) {
+      *px = x;
+      *py = y;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Get the block width of index.
+int ImageIndexBlockWidth(ImageIndex idx) { ///
+  assert(idx != NULL);
+  return idx->bw;
+}
+
+/// Get the block height of index.
+int ImageIndexBlockHeight(ImageIndex idx) { ///
+  assert(idx != NULL);
+  return idx->bh;
+}
+
+/// Filtering
+
+// Largest window area for boxFilter, so that its sums fit in 32 bits.
+#define BOX_MAXAREA (UINT32_MAX / 255)
+
+// Allocate buffers for boxFilter on images of width w, with radius dy
+// (or less) in y.
+static void *boxAlloc(int w, int dy) {
+  void *buf = malloc((size_t)w * (2 * (size_t)dy + 2) * sizeof(uint32_t) + 1);
+  if (!check(buf != NULL, "Out of memory")) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return buf;
+}
+
+// Sliding sums of 2r+1 levels of row p (clipped to [0, w)) into hs.
+static void slidingRow(const uint8 *p, int w, int r, uint32_t *hs) {
+  uint32_t s = 0;
+  int x = 0;
+  for (int i = 0; i <= r && i < w; i++)
+    s += p[i];
+  // Before each step, s is the sum over [x-r, x+r] clipped.
+  for (; x < w && x - r < 0 && x + r + 1 < w; x++) {
+    hs[x] = s;
+    s += p[x + r + 1];
+  }
+  for (; x < w && x + r + 1 < w; x++) {
+    hs[x] = s;
+    s += p[x + r + 1] - p[x - r];
+  }
+  for (; x < w; x++) {
+    hs[x] = s;
+    if (x - r >= 0)
+      s -= p[x - r];
+  }
+}
+
+#ifdef __SSE2__
+// Same as meanRound for sums col[x0..x1) with a common area < 65536, 4 at a
+// time in single precision, which is exact as sums are below 2^24.
+// Returns the first x not done.
+static int meanRow4(uint8 *out, const uint32_t *col, int x0, int x1,
+                    int area) {
+  const __m128 varea = _mm_set1_ps((float)area);
+  const __m128 vinv = _mm_set1_ps(1.0f / (float)area);
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128i half = _mm_set1_epi32(area / 2);
+  int x = x0;
+  for (; x + 4 <= x1; x += 4) {
+    __m128i num = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(col + x)),
+                                half);
+    __m128 fnum = _mm_cvtepi32_ps(num);
+    __m128 q = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(fnum, vinv)));
+    // Correct q if q*area > num, or if (q+1)*area <= num.
+    __m128 over = _mm_cmpgt_ps(_mm_mul_ps(q, varea), fnum);
+    __m128 under = _mm_cmple_ps(_mm_mul_ps(_mm_add_ps(q, one), varea), fnum);
+    q = _mm_sub_ps(q, _mm_and_ps(over, one));
+    q = _mm_add_ps(q, _mm_and_ps(under, one));
+    __m128i v = _mm_cvttps_epi32(q);
+    v = _mm_packs_epi32(v, v);
+    v = _mm_packus_epi16(v, v);
+    int32_t r = _mm_cvtsi128_si32(v);
+    memcpy(out + x, &r, 4);
+  }
+  return x;
+}
+#endif
+
+// Apply a (2dx+1)x(2dy+1) mean filter to img, in-place, in one streaming
+// pass: a ring of the 2dy+1 window rows summed horizontally (with sliding
+// sums), and running column sums of that ring.
+// Each sum is exact, so the result is the same as with ImageBlurIntegral.
+// Requires: (2dx+1)*(2dy+1) <= BOX_MAXAREA.
+// buf is from boxAlloc(img->width, dy) (or larger dy).
+static void boxFilter(Image img, int dx, int dy, void *buf) {
+  int w = img->width;
+  int h = img->height;
+  int ringh = 2 * dy + 1;
+  assert((uint64_t)(2 * dx + 1) * ringh <= BOX_MAXAREA);
+  uint32_t *col = buf;
+  uint32_t *ring = col + w;
+  memset(col, 0, (size_t)w * sizeof(uint32_t));
+
+  // Rows [top, bottom) of the window of the current output row are in the
+  // ring (row r in slot r % ringh) and summed in col.
+  int top = 0;
+  int bottom = 0;
+  for (int y = 0; y < h; y++) {
+    int t = y > dy ? y - dy : 0;
+    int b = y + dy < h ? y + dy + 1 : h;
+    for (; bottom < b; bottom++) {
+      // Row bottom has not been overwritten yet; it replaces row top in
+      // the ring (when the window is full).
+      uint32_t *hs = ring + (size_t)(bottom % ringh) * w;
+      if (top < t) {
+        for (int x = 0; x < w; x++)
+          col[x] -= hs[x];
+        top++;
+      }
+      slidingRow(img->pixel + (size_t)bottom * w, w, dx, hs);
+      for (int x = 0; x < w; x++)
+        col[x] += hs[x];
+      PIXMEM += (unsigned long)w;
+    }
+    for (; top < t; top++) {
+      const uint32_t *hs = ring + (size_t)(top % ringh) * w;
+      for (int x = 0; x < w; x++)
+        col[x] -= hs[x];
+    }
+
+    uint8 *out = img->pixel + (size_t)y * w;
+    uint64_t rh = (uint64_t)(b - t);
+    // Pixels [x0, x1) have full width windows, hence the same area.
+    int x0 = dx < w ? dx : w;
+    int x1 = w - dx > x0 ? w - dx : x0;
+    uint64_t area = rh * (uint64_t)(2 * dx + 1);
+    double inv = 1.0 / (double)area;
+    int x = x0;
+#ifdef __SSE2__
+    if (area < 65536)
+      x = meanRow4(out, col, x0, x1, (int)area);
+#endif
+    for (; x < x1; x++)
+      out[x] = meanRound(col[x], area, inv);
+    for (x = 0; x < w; x++) {
+      if (x == x0)
+        x = x1;
+      if (x >= w)
+        break;
+      int left = x > dx ? x - dx : 0;
+      int right = x + dx < w ? x + dx + 1 : w; // exclusive
+      area = rh * (uint64_t)(right - left);
+      out[x] = (uint8)((col[x] + area / 2) / area);
+    }
+    BLUR_ITS += (unsigned long)w;
+    PIXMEM += (unsigned long)w;
+  }
+}
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+int ImageBlur(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  assert(2 * dx + 1 <= img->width && 2 * dy + 1 <= img->height);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+
+  if ((uint64_t)(2 * dx + 1) * (2 * dy + 1) > BOX_MAXAREA) {
+    // Sums may need 64 bits.
+    IntegralImage ii = IntegralImageCreate(img, 0);
+    if (ii == NULL)
+      return 0;
+    ImageBlurIntegral(img, ii, dx, dy);
+    IntegralImageDestroy(&ii);
+    return 1;
+  }
+  void *buf = boxAlloc(img->width, dy);
+  if (buf == NULL)
+    return 0;
+  boxFilter(img, dx, dy, buf);
+  free(buf);
+  return 1;
+}
+
+/// Bring a blurred copy of img up to date, after img was changed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageBlurUpdate(Image img, Image blurred, int dx, int dy) { ///
+  assert(img != NULL && blurred != NULL && img != blurred);
+  assert(blurred->width == img->width && blurred->height == img->height);
+  assert(dx >= 0 && dy >= 0);
+  assert(2 * dx + 1 <= img->width && 2 * dy + 1 <= img->height);
+  int w = img->width;
+  int h = img->height;
+  for (int i = 0; i < img->ndirty; i++) {
+    const int *r = img->dirty[i];
+    // The output pixels whose windows meet the rectangle, and the input
+    // pixels in their windows.  The windows are clipped by the crop only
+    // where they are clipped by img, so ImageBlur handles them the same.
+    int ox0 = r[0] > dx ? r[0] - dx : 0;
+    int oy0 = r[1] > dy ? r[1] - dy : 0;
+    int ox1 = r[2] < w - dx ? r[2] + dx : w;
+    int oy1 = r[3] < h - dy ? r[3] + dy : h;
+    int ix0 = ox0 > dx ? ox0 - dx : 0;
+    int iy0 = oy0 > dy ? oy0 - dy : 0;
+    int ix1 = ox1 < w - dx ? ox1 + dx : w;
+    int iy1 = oy1 < h - dy ? oy1 + dy : h;
+    Image part = ImageCrop(img, ix0, iy0, ix1 - ix0, iy1 - iy0);
+    int success = part != NULL && ImageBlur(part, dx, dy);
+    success = success && ImagePasteRect(blurred, ox0, oy0, part, ox0 - ix0,
+                                        oy0 - iy0, ox1 - ox0, oy1 - oy0);
+    ImageDestroy(&part);
+    if (!success)
+      return 0;
+  }
+  return 1;
+}
+
+// Number of box passes used to approximate a Gaussian filter.
+#define GAUSS_PASSES 3
+
+/// Blur an image with an approximate Gaussian filter.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageGaussianBlur(Image img, double sigma) { ///
+  assert(img != NULL);
+  assert(sigma >= 0.0);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+
+  // Box widths whose successive application best matches the variance of
+  // the Gaussian: m passes of width wl and the rest of width wl+2, with
+  // wl the largest odd width below the ideal one.
+  // (W. Wells, "Efficient synthesis of Gaussian filters by cascaded
+  // uniform filters", IEEE PAMI, 1986.)
+  int n = GAUSS_PASSES;
+  double ideal = sqrt(12.0 * sigma * sigma / n + 1.0);
+  int wl = (int)floor(ideal);
+  if (wl % 2 == 0)
+    wl--;
+  int m = (int)lround((12.0 * sigma * sigma - n * wl * wl - 4.0 * n * wl -
+                       3.0 * n) /
+                      (-4.0 * wl - 4.0));
+
+  if ((uint64_t)(wl + 2) * (wl + 2) > BOX_MAXAREA) {
+    // Sums may need 64 bits.
+    IntegralImage ii = integralAlloc(img->width, img->height, 0);
+    if (ii == NULL)
+      return 0;
+    for (int pass = 0; pass < n; pass++) {
+      int r = (pass < m ? wl : wl + 2) / 2;
+      integralFill(ii, img, 0, 0);
+      ImageBlurIntegral(img, ii, r, r);
+    }
+    IntegralImageDestroy(&ii);
+    return 1;
+  }
+  void *buf = boxAlloc(img->width, (wl + 2) / 2);
+  if (buf == NULL)
+    return 0;
+  for (int pass = 0; pass < n; pass++) {
+    int r = (pass < m ? wl : wl + 2) / 2;
+    if (r > 0)
+      boxFilter(img, r, r, buf);
+  }
+  free(buf);
+  return 1;
+}
+
+// Same as slidingRow, with sums of squared levels.
+static void slidingRowSq(const uint8 *p, int w, int r, uint64_t *hs) {
+  uint64_t s = 0;
+  int x = 0;
+  for (int i = 0; i <= r && i < w; i++)
+    s += (uint32_t)p[i] * p[i];
+  for (; x < w && x - r < 0 && x + r + 1 < w; x++) {
+    hs[x] = s;
+    s += (uint32_t)p[x + r + 1] * p[x + r + 1];
+  }
+  for (; x < w && x + r + 1 < w; x++) {
+    hs[x] = s;
+    s += (uint32_t)p[x + r + 1] * p[x + r + 1];
+    s -= (uint32_t)p[x - r] * p[x - r];
+  }
+  for (; x < w; x++) {
+    hs[x] = s;
+    if (x - r >= 0)
+      s -= (uint32_t)p[x - r] * p[x - r];
+  }
+}
+
+// Threshold row out (in-place), given the sums col and squared sums col2
+// of its windows, which span rh rows.
+static void thresholdRow(uint8 *out, int w, int dx, int rh,
+                         const uint64_t *col, const uint64_t *col2, double k,
+                         ThresholdMethod method, uint8 maxval) {
+  // Sauvola: mean * (1 + k * (stddev / R - 1)), with R the largest
+  // possible stddev; Bradley: mean * (1 - k).
+  double a = 1.0 - k;
+  double b = method == THR_SAUVOLA ? k / ((maxval + 1) / 2.0) : 0.0;
+  int span = 0;
+  double inv = 0.0;
+  for (int x = 0; x < w; x++) {
+    int left = x > dx ? x - dx : 0;
+    int right = x < w - dx ? x + dx + 1 : w; // exclusive
+    if (right - left != span) {
+      // Only near the borders.
+      span = right - left;
+      inv = 1.0 / ((double)rh * span);
+    }
+    double mean = (double)col[x] * inv;
+    double thr = mean * a;
+    if (b != 0.0) {
+      double var = (double)col2[x] * inv - mean * mean;
+      if (var > 0.0)
+        thr += mean * b * sqrt(var);
+    }
+    out[x] = out[x] < thr ? 0 : maxval;
+  }
+}
+
+/// Apply an adaptive threshold to an image.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageThresholdAdaptive(Image img, int dx, int dy, double k,
+                           ThresholdMethod method) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  assert(method == THR_SAUVOLA || method == THR_BRADLEY);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0)
+    return 1;
+  int ringh = dy < h / 2 ? 2 * dy + 1 : h;
+  // Column sums (and squared), then a ring of the horizontal sums (and
+  // squared) of the window rows, as in boxFilter.
+  size_t cells = (size_t)w * (size_t)ringh;
+  uint64_t *col = malloc((2 * (size_t)w + cells) * sizeof(uint64_t) +
+                         cells * sizeof(uint32_t));
+  if (!check(col != NULL, "Out of memory")) {
+    errno = ENOMEM;
+    return 0;
+  }
+  uint64_t *col2 = col + w;
+  uint64_t *ring2 = col2 + w;
+  uint32_t *ring = (uint32_t *)(ring2 + cells);
+  memset(col, 0, 2 * (size_t)w * sizeof(uint64_t));
+
+  // Rows [top, bottom) are in the ring (row r in slot r % ringh) and summed
+  // in col and col2.  Rows are overwritten only after leaving the window.
+  int top = 0;
+  int bottom = 0;
+  for (int y = 0; y < h; y++) {
+    int t = y > dy ? y - dy : 0;
+    int b = y < h - dy ? y + dy + 1 : h;
+    for (; top < t; top++) {
+      const uint32_t *hs = ring + (size_t)(top % ringh) * w;
+      const uint64_t *hs2 = ring2 + (size_t)(top % ringh) * w;
+      for (int x = 0; x < w; x++) {
+        col[x] -= hs[x];
+        col2[x] -= hs2[x];
+      }
+    }
+    for (; bottom < b; bottom++) {
+      uint32_t *hs = ring + (size_t)(bottom % ringh) * w;
+      uint64_t *hs2 = ring2 + (size_t)(bottom % ringh) * w;
+      const uint8 *p = img->pixel + (size_t)bottom * w;
+      slidingRow(p, w, dx, hs);
+      slidingRowSq(p, w, dx, hs2);
+      for (int x = 0; x < w; x++) {
+        col[x] += hs[x];
+        col2[x] += hs2[x];
+      }
+      PIXMEM += (unsigned long)w;
+    }
+    thresholdRow(img->pixel + (size_t)y * w, w, dx, b - t, col, col2, k,
+                 method, img->maxval);
+    PIXMEM += (unsigned long)w;
+  }
+  free(col);
+  return 1;
+}
+
+// Histograms for the median filter: 16 coarse bins (by the high nibble of
+// the level) followed by 256 fine bins.
+#define HIST_COARSE 16
+#define HIST_BINS (HIST_COARSE + 256)
+
+// Add (sign>0) or subtract (sign<0) 16 consecutive histogram bins.
+static inline void hist16(uint32_t *dst, const uint32_t *src, int sign) {
+#ifdef __SSE2__
+  for (int i = 0; i < 16; i += 4) {
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    d = sign > 0 ? _mm_add_epi32(d, s) : _mm_sub_epi32(d, s);
+    _mm_storeu_si128((__m128i *)(dst + i), d);
+  }
+#else
+  for (int i = 0; i < 16; i++)
+    dst[i] += sign > 0 ? src[i] : -src[i];
+#endif
+}
+
+// Add (sign>0) or remove (sign<0) row y of img to the column histograms.
+static void columnsUpdate(uint32_t *col, Image img, int y, int sign) {
+  const uint8 *p = img->pixel + (size_t)y * img->width;
+  for (int x = 0; x < img->width; x++) {
+    uint32_t *h = col + (size_t)x * HIST_BINS;
+    h[p[x] >> 4] += sign;
+    h[HIST_COARSE + p[x]] += sign;
+  }
+  PIXMEM += (unsigned long)img->width;
+}
+
+/// Apply a median filter to an image.
+/// Perreault & Hébert, "Median filtering in constant time", IEEE TIP, 2007.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageMedian(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+
+  int width = img->width;
+  int height = img->height;
+  // One histogram per column, over the rows of the current window, and
+  // one for the window itself, whose fine bins are only brought up to date
+  // (for the columns [lo[c], hi[c])) when the median falls in coarse bin c.
+  uint32_t *col = calloc((size_t)width * HIST_BINS, sizeof(uint32_t));
+  uint8 *out = malloc((size_t)width * height);
+  if (!check(col != NULL && out != NULL, "Out of memory")) {
+    free(col);
+    free(out);
+    errno = ENOMEM;
+    return 0;
+  }
+  uint32_t kernel[HIST_BINS];
+  int lo[HIST_COARSE];
+  int hi[HIST_COARSE];
+
+  for (int y = 0; y < dy && y < height; y++)
+    columnsUpdate(col, img, y, +1);
+  for (int y = 0; y < height; y++) {
+    if (y - dy - 1 >= 0)
+      columnsUpdate(col, img, y - dy - 1, -1);
+    if (y + dy < height)
+      columnsUpdate(col, img, y + dy, +1);
+    int rows = (y + dy < height ? y + dy + 1 : height) - (y > dy ? y - dy : 0);
+
+    memset(kernel, 0, sizeof(kernel));
+    memset(lo, 0, sizeof(lo));
+    memset(hi, 0, sizeof(hi));
+    int left = 0;  // coarse bins of kernel cover columns [left, right)
+    int right = 0;
+    for (int x = 0; x < width; x++) {
+      MEDIAN_ITS += 1;
+      int l = x > dx ? x - dx : 0;
+      int r = x + dx < width ? x + dx + 1 : width;
+      for (; right < r; right++)
+        hist16(kernel, col + (size_t)right * HIST_BINS, +1);
+      for (; left < l; left++)
+        hist16(kernel, col + (size_t)left * HIST_BINS, -1);
+
+      // Lower median: the level of rank (area-1)/2, counting from 0.
+      uint32_t rank = (uint32_t)(rows * (r - l) - 1) / 2;
+      uint32_t count = 0;
+      int c = 0;
+      while (count + kernel[c] <= rank)
+        count += kernel[c++];
+
+      uint32_t *fine = kernel + HIST_COARSE + 16 * c;
+      if (hi[c] <= l) { // nothing in common: rebuild
+        memset(fine, 0, 16 * sizeof(uint32_t));
+        lo[c] = hi[c] = l;
+      }
+      for (; hi[c] < r; hi[c]++)
+        hist16(fine, col + (size_t)hi[c] * HIST_BINS + HIST_COARSE + 16 * c,
+               +1);
+      for (; lo[c] < l; lo[c]++)
+        hist16(fine, col + (size_t)lo[c] * HIST_BINS + HIST_COARSE + 16 * c,
+               -1);
+
+      int v = 0;
+      while (count + fine[v] <= rank)
+        count += fine[v++];
+      out[(size_t)y * width + x] = (uint8)(16 * c + v);
+    }
+  }
+  memcpy(img->pixel, out, (size_t)width * height);
+  PIXMEM += (unsigned long)width * height;
+  free(col);
+  free(out);
+  return 1;
+}
+
+/// Morphology
+
+// Elementwise min (or max) of two rows of n levels.
+static inline void rowMinMax(uint8 *dst, const uint8 *a, const uint8 *b, int n,
+                             int isMax) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     isMax ? _mm_max_epu8(va, vb) : _mm_min_epu8(va, vb));
+  }
+#endif
+  for (; i < n; i++)
+    dst[i] = isMax ? (a[i] > b[i] ? a[i] : b[i]) : (a[i] < b[i] ? a[i] : b[i]);
+}
+
+// Min (or max) filter over windows of k = 2r+1 consecutive "elements",
+// by van Herk/Gil-Werman: the padded sequence is cut into blocks of k
+// elements, with prefix (g) and suffix (h) extrema inside each block, and
+// the window starting at i is op(h[i], g[i+k-1]), as it spans at most two
+// blocks.  Elements are rows of n levels (for the vertical pass; n=1 gives
+// the scalar horizontal pass), and the sequence is padded with r neutral
+// elements on each side, so windows are clipped at the borders.
+// in(i) is element i of the input, out(i) of the output, of count elements.
+// g and h must hold m*n levels, with m = count + 2r rounded up to k.
+static void vhgw(const uint8 *in, uint8 *out, int count, int stride, int n,
+                 int r, int isMax, uint8 *g, uint8 *h, const uint8 *neutral) {
+  int k = 2 * r + 1;
+  int m = (count + 2 * r + k - 1) / k * k;
+  for (int i = 0; i < m; i++) {
+    const uint8 *p = (i >= r && i < r + count) ? in + (size_t)(i - r) * stride
+                                               : neutral;
+    uint8 *gi = g + (size_t)i * n;
+    if (i % k == 0)
+      memcpy(gi, p, n);
+    else
+      rowMinMax(gi, gi - n, p, n, isMax);
+  }
+  for (int i = m - 1; i >= 0; i--) {
+    const uint8 *p = (i >= r && i < r + count) ? in + (size_t)(i - r) * stride
+                                               : neutral;
+    uint8 *hi = h + (size_t)i * n;
+    if (i % k == k - 1)
+      memcpy(hi, p, n);
+    else
+      rowMinMax(hi, hi + n, p, n, isMax);
+  }
+  for (int i = 0; i < count; i++)
+    rowMinMax(out + (size_t)i * stride, h + (size_t)i * n,
+              g + (size_t)(i + k - 1) * n, n, isMax);
+}
+
+// Width of the column strips of the vertical pass: its buffers hold a
+// strip of the (padded) image, instead of all of it.
+#define MORPH_STRIP 1024
+
+// Min (or max, if isMax) filter with a (2dx+1)x(2dy+1) rectangle,
+// in-place, followed by the opposite filter if twice is nonzero.
+static int minMaxFilter(Image img, int dx, int dy, int isMax, int twice) {
+  int width = img->width;
+  int height = img->height;
+  // Windows that reach across the image cover all of it, wherever they
+  // are centered, so larger radii give the same result.
+  if (dx >= width)
+    dx = width > 0 ? width - 1 : 0;
+  if (dy >= height)
+    dy = height > 0 ? height - 1 : 0;
+  int strip = width < MORPH_STRIP ? width : MORPH_STRIP;
+  // Buffers for the longest padded sequence of either pass.
+  size_t mx = (size_t)width + 4 * (size_t)dx + 1;
+  size_t my = ((size_t)height + 4 * (size_t)dy + 1) * (size_t)strip;
+  size_t size = mx > my ? mx : my;
+  uint8 *g = malloc(size);
+  uint8 *h = malloc(size);
+  uint8 *neutral = malloc((size_t)strip + 1);
+  if (!check(g != NULL && h != NULL && neutral != NULL, "Out of memory")) {
+    free(g);
+    free(h);
+    free(neutral);
+    errno = ENOMEM;
+    return 0;
+  }
+
+  for (int pass = 0; pass <= (twice != 0); pass++) {
+    int op = pass == 0 ? isMax : !isMax;
+    memset(neutral, op ? 0 : 255, (size_t)strip + 1);
+    if (dx > 0) {
+      for (int y = 0; y < height; y++) {
+        uint8 *row = img->pixel + (size_t)y * width;
+        vhgw(row, row, width, 1, 1, dx, op, g, h, neutral);
+      }
+      PIXMEM += 3 * (unsigned long)width * height;
+    }
+    if (dy > 0) {
+      for (int x = 0; x < width; x += strip) {
+        int n = width - x < strip ? width - x : strip;
+        vhgw(img->pixel + x, img->pixel + x, height, width, n, dy, op, g, h,
+             neutral);
+      }
+      PIXMEM += 3 * (unsigned long)width * height;
+    }
+  }
+  free(g);
+  free(h);
+  free(neutral);
+  return 1;
+}
+
+/// Erode an image (minimum filter).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageErode(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+  return minMaxFilter(img, dx, dy, 0, 0);
+}
+
+/// Dilate an image (maximum filter).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageDilate(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+  return minMaxFilter(img, dx, dy, 1, 0);
+}
+
+/// Open an image (erosion followed by dilation).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageOpen(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+  return minMaxFilter(img, dx, dy, 0, 1);
+}
+
+/// Close an image (dilation followed by erosion).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageClose(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+  return minMaxFilter(img, dx, dy, 1, 1);
+}
+
+/// Convolution
+
+// Internal structure for convolution kernels
+struct convKernel {
+  int w, h;       // dimensions (odd)
+  int div;        // divisor (positive)
+  int *coef;      // h rows of w coefficients
+  int *prefix;    // (h+1)x(w+1) summed-area table of coef
+  int separable;  // coef[j*w+i] == col[j]*row[i], with 16-bit intermediates
+  int *row, *col; // factors of a separable kernel
+};
+
+static int gcd(int a, int b) {
+  a = a < 0 ? -a : a;
+  b = b < 0 ? -b : b;
+  while (b != 0) {
+    int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Check if kernel k has rank 1 and, if so, set its integer factors.
+// A nonzero row, divided by the gcd of its elements, is a factor of every
+// other row (if the kernel has rank 1), and the ratios are integers.
+static int factorize(ConvKernel k) {
+  int j0 = 0;
+  int i0 = 0;
+  while (j0 < k->h && k->coef[j0 * k->w + i0] == 0) {
+    if (++i0 == k->w) {
+      i0 = 0;
+      j0++;
+    }
+  }
+  if (j0 == k->h)
+    return 0; // all zeros
+  int g = 0;
+  for (int i = 0; i < k->w; i++)
+    g = gcd(g, k->coef[j0 * k->w + i]);
+  for (int i = 0; i < k->w; i++)
+    k->row[i] = k->coef[j0 * k->w + i] / g;
+  for (int j = 0; j < k->h; j++) {
+    if (k->coef[j * k->w + i0] % k->row[i0] != 0)
+      return 0;
+    k->col[j] = k->coef[j * k->w + i0] / k->row[i0];
+    for (int i = 0; i < k->w; i++) {
+      if (k->coef[j * k->w + i] != k->col[j] * k->row[i])
+        return 0;
+    }
+  }
+  return 1;
+}
+
+/// Create a convolution kernel.
+/// On success, a new kernel is returned.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ConvKernel ConvKernelCreate(int w, int h, const int coef[], int div) { ///
+  assert(w > 0 && h > 0 && w % 2 == 1 && h % 2 == 1);
+  assert(div > 0);
+  long total = 0;
+  for (int i = 0; i < w * h; i++) {
+    assert(coef[i] >= -32767 && coef[i] <= 32767);
+    total += coef[i] < 0 ? -coef[i] : coef[i];
+  }
+  assert(total <= INT32_MAX / 255); // sums of products fit in 32 bits
+
+  ConvKernel k = malloc(sizeof(struct convKernel));
+  int *mem = malloc(((size_t)w * h + (size_t)(w + 1) * (h + 1) + w + h) *
+                    sizeof(int));
+  if (!check(k != NULL && mem != NULL, "Out of memory")) {
+    free(k);
+    free(mem);
+    errno = ENOMEM;
+    return NULL;
+  }
+  k->w = w;
+  k->h = h;
+  k->div = div;
+  k->coef = mem;
+  k->prefix = k->coef + w * h;
+  k->row = k->prefix + (w + 1) * (h + 1);
+  k->col = k->row + w;
+  memcpy(k->coef, coef, (size_t)w * h * sizeof(int));
+  for (int i = 0; i <= w; i++)
+    k->prefix[i] = 0;
+  for (int j = 0; j < h; j++) {
+    int rowsum = 0;
+    k->prefix[(j + 1) * (w + 1)] = 0;
+    for (int i = 0; i < w; i++) {
+      rowsum += coef[j * w + i];
+      k->prefix[(j + 1) * (w + 1) + i + 1] =
+          k->prefix[j * (w + 1) + i + 1] + rowsum;
+    }
+  }
+  k->separable = factorize(k);
+  if (k->separable) {
+    // The horizontal pass results are kept in 16 bits.
+    long rowtotal = 0;
+    for (int i = 0; i < w; i++)
+      rowtotal += k->row[i] < 0 ? -k->row[i] : k->row[i];
+    k->separable = 255 * rowtotal <= INT16_MAX;
+  }
+  return k;
+}
+
+/// Destroy the kernel pointed to by (*kp).
+void ConvKernelDestroy(ConvKernel *kp) { ///
+  assert(kp != NULL);
+  if (*kp == NULL)
+    return;
+  free((*kp)->coef);
+  free(*kp);
+  *kp = NULL;
+}
+
+/// Check if kernel is applied as two 1D passes.
+int ConvKernelSeparable(ConvKernel k) { ///
+  assert(k != NULL);
+  return k->separable;
+}
+
+// acc[x] += c0*a[x] + c1*b[x], for x in [0, n).
+// With SSE2, a and b are interleaved and multiplied by (c0, c1) pairs with
+// pmaddwd, which widens the 16-bit products and adds them in 32 bits.
+static inline void macRow(int32_t *acc, const int16_t *a, const int16_t *b,
+                          int n, int c0, int c1) {
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i c = _mm_set1_epi32((int)((uint32_t)(uint16_t)c0 |
+                                         ((uint32_t)(uint16_t)c1 << 16)));
+  for (; x + 8 <= n; x += 8) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(va, vb), c);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(va, vb), c);
+    __m128i *p = (__m128i *)(acc + x);
+    _mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), lo));
+    _mm_storeu_si128(p + 1, _mm_add_epi32(_mm_loadu_si128(p + 1), hi));
+  }
+#endif
+  for (; x < n; x++)
+    acc[x] += c0 * a[x] + c1 * b[x];
+}
+
+// acc[x] (+)= sum of taps[i]*src[i][x], for x in [0, n), i in [0, ntaps):
+// adds to acc if accumulate is nonzero, or overwrites it otherwise.
+static void macTaps(int32_t *acc, const int16_t *const src[], const int *taps,
+                    int ntaps, int n, int accumulate) {
+  if (!accumulate)
+    memset(acc, 0, (size_t)n * sizeof(int32_t));
+  int i = 0;
+  for (; i + 2 <= ntaps; i += 2)
+    macRow(acc, src[i], src[i + 1], n, taps[i], taps[i + 1]);
+  if (i < ntaps)
+    macRow(acc, src[i], src[i], n, taps[i], 0);
+}
+
+#ifndef CONV_GENERIC_ONLY
+// Same as macTaps, for a fixed number of taps N <= 7.  Once inlined with
+// a constant N, the unused steps vanish, the coefficient pairs stay in
+// registers, and each group of 8 sums is stored once (instead of being
+// loaded and stored again for every pair of taps).
+static inline void macTapsFixed(int32_t *acc, const int16_t *const src[],
+                                const int *taps, int n, int accumulate,
+                                const int N) {
+  int x = 0;
+#ifdef __SSE2__
+// Coefficient pair (taps[i], taps[i+1]), or (taps[i], 0) for the last one.
+#define MAC_PAIR(i)                                                            \
+  (i < N ? _mm_set1_epi32((int)((uint32_t)(uint16_t)taps[i] |                  \
+                                ((uint32_t)(uint16_t)(i + 1 < N ? taps[i + 1]  \
+                                                                : 0)           \
+                                 << 16)))                                      \
+         : _mm_setzero_si128())
+// Multiply-accumulate rows i and i+1 (if within the N taps).
+#define MAC_STEP(i, c)                                                         \
+  if (i < N) {                                                                 \
+    __m128i va = _mm_loadu_si128((const __m128i *)(src[i] + x));               \
+    __m128i vb = i + 1 < N                                                     \
+                     ? _mm_loadu_si128((const __m128i *)(src[i + 1] + x))      \
+                     : _mm_setzero_si128();                                    \
+    lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(va, vb), c));     \
+    hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(va, vb), c));     \
+  }
+  const __m128i c0 = MAC_PAIR(0);
+  const __m128i c1 = MAC_PAIR(2);
+  const __m128i c2 = MAC_PAIR(4);
+  const __m128i c3 = MAC_PAIR(6);
+  for (; x + 8 <= n; x += 8) {
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    MAC_STEP(0, c0)
+    MAC_STEP(2, c1)
+    MAC_STEP(4, c2)
+    MAC_STEP(6, c3)
+    __m128i *p = (__m128i *)(acc + x);
+    if (accumulate) {
+      lo = _mm_add_epi32(lo, _mm_loadu_si128(p));
+      hi = _mm_add_epi32(hi, _mm_loadu_si128(p + 1));
+    }
+    _mm_storeu_si128(p, lo);
+    _mm_storeu_si128(p + 1, hi);
+  }
+#undef MAC_STEP
+#undef MAC_PAIR
+#endif
+  for (; x < n; x++) {
+    int32_t s = accumulate ? acc[x] : 0;
+    for (int i = 0; i < N; i++)
+      s += taps[i] * src[i][x];
+    acc[x] = s;
+  }
+}
+
+// Specialised versions of macTaps for radius R (2R+1 taps).
+#define MAC_TAPS(R)                                                            \
+  static void macTaps##R(int32_t *acc, const int16_t *const src[],            \
+                         const int *taps, int n, int accumulate) {            \
+    macTapsFixed(acc, src, taps, n, accumulate, 2 * (R) + 1);                 \
+  }
+MAC_TAPS(1)
+MAC_TAPS(2)
+MAC_TAPS(3)
+#undef MAC_TAPS
+
+// Specialised kernels, by radius.
+static void (*const macTapsRadius[])(int32_t *, const int16_t *const[],
+                                     const int *, int, int) = {
+    NULL, macTaps1, macTaps2, macTaps3};
+#endif
+
+// Apply ntaps taps to n positions, with a specialised kernel if available.
+// Used by both passes of separable kernels (horizontal: src[i] are shifts
+// of one padded row; vertical: src[i] are consecutive rows) and by each
+// kernel row of 2D kernels.
+static inline void convTaps(int32_t *acc, const int16_t *const src[],
+                            const int *taps, int ntaps, int n,
+                            int accumulate) {
+#ifndef CONV_GENERIC_ONLY
+  int r = ntaps / 2;
+  if (r >= 1 && r < (int)(sizeof(macTapsRadius) / sizeof(macTapsRadius[0]))) {
+    macTapsRadius[r](acc, src, taps, n, accumulate);
+    return;
+  }
+#endif
+  macTaps(acc, src, taps, ntaps, n, accumulate);
+}
+
+// Convert row y of img (or a row of zeros, if y is outside and edge is
+// CONV_SHRINK) to 16 bits, padded with r levels on each side.
+static void padRow(int16_t *dst, Image img, int y, int r, ConvEdge edge) {
+  int w = img->width;
+  if (edge == CONV_REPLICATE)
+    y = y < 0 ? 0 : (y >= img->height ? img->height - 1 : y);
+  if (y < 0 || y >= img->height) {
+    memset(dst, 0, (size_t)(w + 2 * r) * sizeof(int16_t));
+    return;
+  }
+  const uint8 *p = img->pixel + (size_t)y * w;
+  int x = 0;
+#ifdef __SSE2__
+  for (; x + 16 <= w; x += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + x));
+    __m128i *q = (__m128i *)(dst + r + x);
+    _mm_storeu_si128(q, _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+    _mm_storeu_si128(q + 1, _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+  }
+#endif
+  for (; x < w; x++)
+    dst[r + x] = p[x];
+  for (int i = 0; i < r; i++) {
+    dst[i] = edge == CONV_REPLICATE ? p[0] : 0;
+    dst[r + w + i] = edge == CONV_REPLICATE ? p[w - 1] : 0;
+  }
+  PIXMEM += (unsigned long)w;
+}
+
+// Narrow n 32-bit sums to 16 bits (they are known to fit).
+static void narrowRow(int16_t *dst, const int32_t *src, int n) {
+  int x = 0;
+#ifdef __SSE2__
+  for (; x + 8 <= n; x += 8) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)(src + x));
+    __m128i hi = _mm_loadu_si128((const __m128i *)(src + x + 4));
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_packs_epi32(lo, hi));
+  }
+#endif
+  for (; x < n; x++)
+    dst[x] = (int16_t)src[x];
+}
+
+// Round num/den (den > 0) to the nearest integer, halves up, as ImageBlur.
+static inline int64_t divRound(int64_t num, int64_t den) {
+  int64_t q = (2 * num + den) / (2 * den);
+  return q * 2 * den > 2 * num + den ? q - 1 : q; // floor, for negatives
+}
+
+// Store the convolution sums acc of row y of img, divided and clamped.
+// With CONV_SHRINK, the sums near the borders only include the taps that
+// fall inside the image, and are rescaled by (total weight)/(weight of
+// those taps), unless either is zero.
+static void storeRow(Image img, int y, const int32_t *acc, ConvKernel k,
+                     ConvEdge edge) {
+  int w = img->width;
+  int rx = k->w / 2;
+  int ry = k->h / 2;
+  uint8 *out = img->pixel + (size_t)y * w;
+
+  // Pixels [x0, x1) use all taps, or replicated ones: plain division.
+  int x0 = 0;
+  int x1 = w;
+  if (edge == CONV_SHRINK) {
+    x0 = y < ry || y >= img->height - ry ? w : (rx < w ? rx : w);
+    x1 = w - rx > x0 ? w - rx : x0;
+  }
+  int shift = 0;
+  while ((1 << shift) < k->div)
+    shift++;
+  int half = k->div / 2;
+  int x = x0;
+  if ((1 << shift) == k->div) {
+#ifdef __SSE2__
+    const __m128i vhalf = _mm_set1_epi32(half);
+    const __m128i vmax = _mm_set1_epi8((char)img->maxval);
+    for (; x + 8 <= x1; x += 8) {
+      __m128i lo = _mm_loadu_si128((const __m128i *)(acc + x));
+      __m128i hi = _mm_loadu_si128((const __m128i *)(acc + x + 4));
+      lo = _mm_srai_epi32(_mm_add_epi32(lo, vhalf), shift);
+      hi = _mm_srai_epi32(_mm_add_epi32(hi, vhalf), shift);
+      __m128i v = _mm_packus_epi16(_mm_packs_epi32(lo, hi),
+                                   _mm_setzero_si128()); // clamps to [0, 255]
+      _mm_storel_epi64((__m128i *)(out + x), _mm_min_epu8(v, vmax));
+    }
+#endif
+    for (; x < x1; x++) {
+      int64_t v = ((int64_t)acc[x] + half) >> shift;
+      out[x] = (uint8)(v < 0 ? 0 : (v > img->maxval ? img->maxval : v));
+    }
+  } else {
+    for (; x < x1; x++) {
+      // Negative results clamp to 0, so unsigned division suffices.
+      int64_t s = (int64_t)acc[x] + half;
+      uint32_t v = s < 0 ? 0 : (uint32_t)s / (uint32_t)k->div;
+      out[x] = (uint8)(v > img->maxval ? img->maxval : v);
+    }
+  }
+
+  // The other pixels (near the borders, with CONV_SHRINK).
+  int j0 = y < ry ? ry - y : 0;
+  int j1 = y + ry >= img->height ? ry + img->height - y : k->h; // exclusive
+  int stride = k->w + 1;
+  int total = k->prefix[k->h * stride + k->w];
+  for (x = 0; x < w; x++) {
+    if (x == x0)
+      x = x1;
+    if (x >= w)
+      break;
+    int i0 = x < rx ? rx - x : 0;
+    int i1 = x + rx >= w ? rx + w - x : k->w;
+    int inside = k->prefix[j1 * stride + i1] - k->prefix[j0 * stride + i1] -
+                 k->prefix[j1 * stride + i0] + k->prefix[j0 * stride + i0];
+    int64_t v;
+    if (total != 0 && inside != 0 && inside != total) {
+      int64_t num = (int64_t)acc[x] * total;
+      int64_t den = (int64_t)k->div * inside;
+      v = den > 0 ? divRound(num, den) : divRound(-num, -den);
+    } else {
+      v = divRound(acc[x], k->div);
+    }
+    out[x] = (uint8)(v < 0 ? 0 : (v > img->maxval ? img->maxval : v));
+  }
+  PIXMEM += (unsigned long)w;
+}
+
+/// Convolve an image with a kernel.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageConvolve(Image img, ConvKernel k, ConvEdge edge) { ///
+  assert(img != NULL && k != NULL);
+  assert(edge == CONV_REPLICATE || edge == CONV_SHRINK);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+
+  int w = img->width;
+  int rx = k->w / 2;
+  int ry = k->h / 2;
+  int pw = w + 2 * rx;
+  // Ring of the h most recent input rows: padded (2D kernels), or after
+  // the horizontal pass (separable kernels).
+  int ringw = k->separable ? w : pw;
+  int16_t *ring = malloc((size_t)k->h * ringw * sizeof(int16_t));
+  int16_t *pad = malloc((size_t)pw * sizeof(int16_t));
+  int32_t *acc = malloc((size_t)(pw > 0 ? pw : 1) * sizeof(int32_t));
+  const int16_t **src = malloc((size_t)(k->w > k->h ? k->w : k->h) *
+                               sizeof(int16_t *));
+  if (!check(ring != NULL && pad != NULL && acc != NULL && src != NULL,
+             "Out of memory")) {
+    free(ring);
+    free(pad);
+    free(acc);
+    free(src);
+    errno = ENOMEM;
+    return 0;
+  }
+
+  // Input row s goes to ring slot (s+ry) % h.  Rows are loaded just before
+  // the first output row that needs them, which is never after it has
+  // been overwritten, so the image can be changed in-place.
+  for (int s = -ry; s < img->height + ry; s++) {
+    int16_t *slot = ring + (size_t)((s + ry) % k->h) * ringw;
+    if (k->separable) {
+      padRow(pad, img, s, rx, edge);
+      for (int i = 0; i < k->w; i++)
+        src[i] = pad + i;
+      convTaps(acc, src, k->row, k->w, w, 0);
+      narrowRow(slot, acc, w);
+    } else {
+      padRow(slot, img, s, rx, edge);
+    }
+
+    int y = s - ry; // output row whose window is now complete
+    if (y < 0)
+      continue;
+    CONV_ITS += (unsigned long)w;
+    if (k->separable) {
+      for (int j = 0; j < k->h; j++)
+        src[j] = ring + (size_t)((y + j) % k->h) * ringw;
+      convTaps(acc, src, k->col, k->h, w, 0);
+    } else {
+      for (int j = 0; j < k->h; j++) {
+        const int16_t *r = ring + (size_t)((y + j) % k->h) * ringw;
+        for (int i = 0; i < k->w; i++)
+          src[i] = r + i;
+        convTaps(acc, src, k->coef + j * k->w, k->w, w, j > 0);
+      }
+    }
+    storeRow(img, y, acc, k, edge);
+  }
+  free(ring);
+  free(pad);
+  free(acc);
+  free(src);
+  return 1;
+}
+
+/// Edge detection
+
+// Sobel derivatives of the middle one of 3 consecutive rows (r0, r1, r2,
+// padded with 1 level on each side), in 16 bits: |gx|, |gy| <= 1020.
+static void sobelRow(const int16_t *r0, const int16_t *r1, const int16_t *r2,
+                     int w, int16_t *gx, int16_t *gy) {
+  int x = 0;
+#ifdef __SSE2__
+  for (; x + 8 <= w; x += 8) {
+#define LOAD(r, d) _mm_loadu_si128((const __m128i *)((r) + x + (d)))
+    __m128i dx0 = _mm_sub_epi16(LOAD(r0, 2), LOAD(r0, 0));
+    __m128i dx1 = _mm_sub_epi16(LOAD(r1, 2), LOAD(r1, 0));
+    __m128i dx2 = _mm_sub_epi16(LOAD(r2, 2), LOAD(r2, 0));
+    __m128i dy0 = _mm_sub_epi16(LOAD(r2, 0), LOAD(r0, 0));
+    __m128i dy1 = _mm_sub_epi16(LOAD(r2, 1), LOAD(r0, 1));
+    __m128i dy2 = _mm_sub_epi16(LOAD(r2, 2), LOAD(r0, 2));
+#undef LOAD
+    __m128i vx = _mm_add_epi16(_mm_add_epi16(dx0, dx2), _mm_slli_epi16(dx1, 1));
+    __m128i vy = _mm_add_epi16(_mm_add_epi16(dy0, dy2), _mm_slli_epi16(dy1, 1));
+    _mm_storeu_si128((__m128i *)(gx + x), vx);
+    _mm_storeu_si128((__m128i *)(gy + x), vy);
+  }
+#endif
+  for (; x < w; x++) {
+    gx[x] = (int16_t)(r0[x + 2] - r0[x] + 2 * (r1[x + 2] - r1[x]) + r2[x + 2] -
+                      r2[x]);
+    gy[x] = (int16_t)(r2[x] - r0[x] + 2 * (r2[x + 1] - r0[x + 1]) + r2[x + 2] -
+                      r0[x + 2]);
+  }
+}
+
+// Squared gradient magnitudes gx^2 + gy^2 (exact, in 32 bits).
+static void sobelMag2(const int16_t *gx, const int16_t *gy, int w,
+                      int32_t *mag2) {
+  int x = 0;
+#ifdef __SSE2__
+  for (; x + 8 <= w; x += 8) {
+    __m128i vx = _mm_loadu_si128((const __m128i *)(gx + x));
+    __m128i vy = _mm_loadu_si128((const __m128i *)(gy + x));
+    __m128i lo = _mm_unpacklo_epi16(vx, vy);
+    __m128i hi = _mm_unpackhi_epi16(vx, vy);
+    _mm_storeu_si128((__m128i *)(mag2 + x), _mm_madd_epi16(lo, lo));
+    _mm_storeu_si128((__m128i *)(mag2 + x + 4), _mm_madd_epi16(hi, hi));
+  }
+#endif
+  for (; x < w; x++)
+    mag2[x] = gx[x] * gx[x] + gy[x] * gy[x];
+}
+
+// Store the gradient magnitudes sqrt(mag2), rounded and clamped.
+// Single precision in both paths, so that they round identically.
+static void storeMag(uint8 *out, const int32_t *mag2, int w, uint8 maxval) {
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i vmax = _mm_set1_epi8((char)maxval);
+  for (; x + 8 <= w; x += 8) {
+    __m128 lo = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(mag2 + x)));
+    __m128 hi =
+        _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(mag2 + x + 4)));
+    __m128i v = _mm_packs_epi32(_mm_cvtps_epi32(_mm_sqrt_ps(lo)),
+                                _mm_cvtps_epi32(_mm_sqrt_ps(hi)));
+    v = _mm_packus_epi16(v, _mm_setzero_si128());
+    _mm_storel_epi64((__m128i *)(out + x), _mm_min_epu8(v, vmax));
+  }
+#endif
+  for (; x < w; x++) {
+    long v = lrintf(sqrtf((float)mag2[x]));
+    out[x] = (uint8)(v > maxval ? maxval : v);
+  }
+}
+
+// Buffers for a sweep of Sobel derivatives down an image: a ring of 3
+// padded input rows, and a ring of 3 rows of derivatives and of squared
+// magnitudes (these with a zero on each side, and a row of zeros).
+struct sobelSweep {
+  int16_t *in[3];
+  int16_t *gx[3];
+  int16_t *gy[3];
+  int32_t *mag2[4]; // mag2[3] is all zeros
+  void *mem;
+};
+
+// Allocate the buffers of a sweep of img.
+static int sweepInit(struct sobelSweep *s, Image img) {
+  size_t row = (size_t)img->width + 2;
+  s->mem = calloc(row, 4 * sizeof(int32_t) + 9 * sizeof(int16_t));
+  if (!check(s->mem != NULL, "Out of memory")) {
+    errno = ENOMEM;
+    return 0;
+  }
+  int32_t *m = s->mem;
+  int16_t *p = (int16_t *)(m + 4 * row);
+  for (int i = 0; i < 4; i++)
+    s->mag2[i] = m + i * row + 1;
+  for (int i = 0; i < 3; i++) {
+    s->in[i] = p + (3 * i) * row;
+    s->gx[i] = p + (3 * i + 1) * row;
+    s->gy[i] = p + (3 * i + 2) * row;
+  }
+  return 1;
+}
+
+// Start a sweep of img: load input rows -1 and 0 (row r goes to slot
+// (r+1)%3).
+static void sweepStart(struct sobelSweep *s, Image img) {
+  padRow(s->in[0], img, -1, 1, CONV_REPLICATE);
+  padRow(s->in[1], img, 0, 1, CONV_REPLICATE);
+}
+
+// Load input row y+1, and compute the derivatives and squared magnitudes
+// of row y into slot y%3.  Rows are processed in order, from y=0.
+static void sweepRow(struct sobelSweep *s, Image img, int y) {
+  padRow(s->in[(y + 2) % 3], img, y + 1, 1, CONV_REPLICATE);
+  int i = y % 3;
+  sobelRow(s->in[i], s->in[(y + 1) % 3], s->in[(y + 2) % 3], img->width,
+           s->gx[i], s->gy[i]);
+  sobelMag2(s->gx[i], s->gy[i], img->width, s->mag2[i]);
+}
+
+/// Compute the gradient magnitude of an image (Sobel operator).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageSobel(Image img, Image dir) { ///
+  assert(img != NULL);
+  assert(dir == NULL ||
+         (dir->width == img->width && dir->height == img->height));
+  if (!willChange(img, 0, 0, img->width, img->height) ||
+      (dir != NULL && !willChange(dir, 0, 0, dir->width, dir->height)))
+    return 0;
+
+  struct sobelSweep s;
+  if (!sweepInit(&s, img))
+    return 0;
+  sweepStart(&s, img);
+  // Each input row is loaded before the output row above it is stored,
+  // so the image can be changed in-place.
+  for (int y = 0; y < img->height; y++) {
+    sweepRow(&s, img, y);
+    int i = y % 3;
+    storeMag(img->pixel + (size_t)y * img->width, s.mag2[i], img->width,
+             img->maxval);
+    if (dir != NULL) {
+      uint8 *d = dir->pixel + (size_t)y * dir->width;
+      for (int x = 0; x < img->width; x++) {
+        double a = atan2(s.gy[i][x], s.gx[i][x]) / (2.0 * M_PI);
+        int v = (int)floor((a < 0.0 ? a + 1.0 : a) * (dir->maxval + 1.0));
+        d[x] = (uint8)(v > dir->maxval ? 0 : v); // 1.0 wraps to 0
+      }
+    }
+    PIXMEM += 2 * (unsigned long)img->width;
+  }
+  free(s.mem);
+  return 1;
+}
+
+// Non-maximum suppression and double threshold of row y (whose gradient
+// is in ring slot i): sets each pixel of out to 0 (no edge), 1 (weak) or
+// 3 (strong, and then also pushed on the stack, at *top).  up and down are
+// the squared magnitudes of rows y-1 and y+1.
+static void cannyRow(const struct sobelSweep *s, int i, const int32_t *up,
+                     const int32_t *down, int y, int w, int32_t low2,
+                     int32_t high2, uint8 *out, uint32_t *stack,
+                     size_t *top) {
+  const int32_t *mid = s->mag2[i];
+  const int32_t *rows[3] = {up, mid, down};
+  static const int ndx[4] = {1, 0, 1, -1};
+  static const int ndy[4] = {0, 1, 1, 1};
+  int x = 0;
+  while (x < w) {
+#ifdef __SSE2__
+    // Skip groups of 4 pixels below the low threshold (most of them).
+    const __m128i vlow = _mm_set1_epi32(low2 > 0 ? low2 : 1);
+    while (x + 4 <= w &&
+           _mm_movemask_epi8(_mm_cmplt_epi32(
+               _mm_loadu_si128((const __m128i *)(mid + x)), vlow)) == 0xFFFF) {
+      memset(out + x, 0, 4);
+      x += 4;
+    }
+    if (x >= w)
+      break;
+#endif
+    int32_t m = mid[x];
+    if (m < low2 || m == 0) {
+      out[x++] = 0;
+      continue;
+    }
+    int gx = s->gx[i][x];
+    int gy = s->gy[i][x];
+    int ax = gx < 0 ? -gx : gx;
+    int ay = gy < 0 ? -gy : gy;
+    // Direction of the gradient: within 22.5 degrees of horizontal (0),
+    // of vertical (1), or diagonal down-right (2) or down-left (3).
+    // Selected without branches, as it changes unpredictably.
+    int d = 12 * ay <= 5 * ax ? 0
+            : 5 * ay >= 12 * ax ? 1
+                                : 2 + ((gx < 0) != (gy < 0));
+    // Neighbours along the gradient direction.
+    int32_t before = rows[1 - ndy[d]][x - ndx[d]];
+    int32_t after = rows[1 + ndy[d]][x + ndx[d]];
+    if (m > before && m >= after) {
+      out[x] = m >= high2 ? 3 : 1;
+      if (m >= high2)
+        stack[(*top)++] = (uint32_t)((size_t)y * w + x);
+    } else {
+      out[x] = 0;
+    }
+    x++;
+  }
+}
+
+/// Detect edges in an image (Canny).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageCanny(Image img, double sigma, int low, int high) { ///
+  assert(img != NULL);
+  assert(sigma >= 0.0);
+  assert(0 <= low && low <= high);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+
+  int w = img->width;
+  int h = img->height;
+  struct sobelSweep s;
+  uint32_t *stack = malloc((size_t)w * h * sizeof(uint32_t) + 1);
+  if (!check(stack != NULL, "Out of memory")) {
+    errno = ENOMEM;
+    return 0;
+  }
+  if (!sweepInit(&s, img)) {
+    free(stack);
+    return 0;
+  }
+  if (sigma > 0.0 && !ImageGaussianBlur(img, sigma)) {
+    errsave = errno;
+    free(s.mem);
+    free(stack);
+    errno = errsave;
+    return 0;
+  }
+  sweepStart(&s, img);
+
+  // Magnitudes above 1443 > 1020*sqrt(2) cannot occur.
+  int32_t low2 = low > 1443 ? INT32_MAX : low * low;
+  int32_t high2 = high > 1443 ? INT32_MAX : high * high;
+  const int32_t *zeros = s.mag2[3];
+  size_t top = 0;
+  for (int y = 0; y <= h; y++) {
+    if (y < h)
+      sweepRow(&s, img, y);
+    if (y >= 1) {
+      int i = (y - 1) % 3;
+      cannyRow(&s, i, y >= 2 ? s.mag2[(y - 2) % 3] : zeros,
+               y < h ? s.mag2[y % 3] : zeros, y - 1, w, low2, high2,
+               img->pixel + (size_t)(y - 1) * w, stack, &top);
+    }
+  }
+  PIXMEM += (unsigned long)w * h;
+
+  // Hysteresis: edges are the strong pixels (on the stack) and the weak
+  // pixels connected to them (8-connectivity).  Edge pixels are marked 3.
+  uint8 *label = img->pixel;
+  while (top > 0) {
+    uint32_t p = stack[--top];
+    int x = (int)(p % w);
+    int y = (int)(p / w);
+    int x0 = x > 0 ? x - 1 : x;
+    int x1 = x < w - 1 ? x + 1 : x;
+    int y0 = y > 0 ? y - 1 : y;
+    int y1 = y < h - 1 ? y + 1 : y;
+    for (int ny = y0; ny <= y1; ny++) {
+      uint8 *row = label + (size_t)ny * w;
+      for (int nx = x0; nx <= x1; nx++) {
+        if (row[nx] == 1) {
+          row[nx] = 3;
+          stack[top++] = (uint32_t)((size_t)ny * w + nx);
+        }
+      }
+    }
+  }
+  size_t size = (size_t)w * h;
+  size_t p = 0;
+#ifdef __SSE2__
+  const __m128i three = _mm_set1_epi8(3);
+  const __m128i vmax = _mm_set1_epi8((char)img->maxval);
+  for (; p + 16 <= size; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(label + p));
+    _mm_storeu_si128((__m128i *)(label + p),
+                     _mm_and_si128(_mm_cmpeq_epi8(v, three), vmax));
+  }
+#endif
+  for (; p < size; p++)
+    label[p] = label[p] == 3 ? img->maxval : 0;
+  PIXMEM += 2 * (unsigned long)w * h;
+
+  free(s.mem);
+  free(stack);
+  return 1;
+}
+
+/// Contrast enhancement
+
+// Replace each level l of the n pixels at p by lut[l].
+static void applyLut(uint8 *p, size_t n, const uint8 lut[256]) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint8 a = lut[p[i]];
+    uint8 b = lut[p[i + 1]];
+    uint8 c = lut[p[i + 2]];
+    uint8 d = lut[p[i + 3]];
+    p[i] = a;
+    p[i + 1] = b;
+    p[i + 2] = c;
+    p[i + 3] = d;
+  }
+  for (; i < n; i++)
+    p[i] = lut[p[i]];
+}
+
+/// Equalize the histogram of an image.
+int ImageEqualize(Image img) { ///
+  assert(img != NULL);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+  uint32_t hist[256];
+  ImageHistogram(img, hist);
+  uint64_t total = (uint64_t)img->width * img->height;
+  // Levels are spread so that the lowest one present maps to 0 and the
+  // highest to maxval.
+  uint64_t cdf = 0;
+  uint64_t cdfmin = 0;
+  int l = 0;
+  while (l < 256 && hist[l] == 0)
+    l++;
+  if (l < 256)
+    cdfmin = hist[l];
+  if (total == cdfmin)
+    return 1; // empty or flat image
+  uint8 lut[256];
+  for (l = 0; l < 256; l++) {
+    cdf += hist[l];
+    uint64_t num = cdf > cdfmin ? (cdf - cdfmin) * img->maxval : 0;
+    uint64_t den = total - cdfmin;
+    lut[l] = (uint8)((num + den / 2) / den);
+  }
+  applyLut(img->pixel, (size_t)total, lut);
+  PIXMEM += (unsigned long)total;
+  return 1;
+}
+
+// Fill lut with the clipped histogram equalization of the n pixels counted
+// in hist (which is modified).
+static void claheLut(uint32_t hist[256], uint32_t n, double clip,
+                     uint8 maxval, uint8 lut[256]) {
+  double limit = clip * n / 256.0;
+  uint32_t cap = limit < 1.0 ? 1 : limit >= n ? n : (uint32_t)limit;
+  uint32_t excess = 0;
+  for (int l = 0; l < 256; l++) {
+    if (hist[l] > cap) {
+      excess += hist[l] - cap;
+      hist[l] = cap;
+    }
+  }
+  // Redistribute the excess evenly, the remainder one per bin, spaced out.
+  uint32_t each = excess / 256;
+  uint32_t rest = excess % 256;
+  for (int l = 0; l < 256; l++)
+    hist[l] += each;
+  if (rest > 0) {
+    int step = 256 / rest;
+    for (int l = 0; l < 256 && rest > 0; l += step, rest--)
+      hist[l]++;
+  }
+  uint64_t cdf = 0;
+  for (int l = 0; l < 256; l++) {
+    cdf += hist[l];
+    lut[l] = (uint8)((cdf * maxval + n / 2) / n);
+  }
+}
+
+// Bilinear weights (in 1/256) along an axis of size len split in t tiles:
+// pixel i is interpolated from tiles tile[i] and tile[i]+1 (or just the
+// first or last one, beyond their centers) with weight wt[i] for the
+// latter.
+static void claheWeights(int len, int t, int *tile, int *wt) {
+  int i0 = 0;
+  for (int i = 0; i < len; i++) {
+    // Tile k spans [k*len/t, (k+1)*len/t); centers in half pixels.
+    // c(k) = k*len/t + (k+1)*len/t, and the pixel center is 2i+1.
+    while (i0 + 1 < t && (int64_t)(i0 + 1) * len / t +
+                                 (int64_t)(i0 + 2) * len / t <=
+                             2 * i + 1)
+      i0++;
+    int64_t c0 = (int64_t)i0 * len / t + (int64_t)(i0 + 1) * len / t;
+    int64_t c1 = (int64_t)(i0 + 1) * len / t + (int64_t)(i0 + 2) * len / t;
+    int64_t p = 2 * i + 1;
+    if (i0 + 1 >= t || p <= c0) {
+      // Before the first center, or after the last one.
+      tile[i] = i0 + 1 >= t ? t - 1 : i0;
+      wt[i] = 0;
+    } else {
+      tile[i] = i0;
+      wt[i] = (int)((256 * (p - c0) + (c1 - c0) / 2) / (c1 - c0));
+    }
+  }
+}
+
+/// Apply contrast-limited adaptive histogram equalization to an image.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageCLAHE(Image img, int tx, int ty, double clip) { ///
+  assert(img != NULL);
+  assert(tx >= 1 && tx <= img->width);
+  assert(ty >= 1 && ty <= img->height);
+  assert(clip >= 1.0);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+  int w = img->width;
+  int h = img->height;
+
+  // Per tile LUTs; per column tile and weight; per row blended LUTs (in
+  // 1/256 of a level); per row of tiles histograms.
+  size_t ntiles = (size_t)tx * ty;
+  size_t bytes = ntiles * 256 + 2 * (size_t)(w + h) * sizeof(int) +
+                 (size_t)tx * 256 * sizeof(uint16_t) +
+                 (size_t)tx * 256 * sizeof(uint32_t);
+  void *mem = malloc(bytes);
+  if (!check(mem != NULL, "Out of memory")) {
+    errno = ENOMEM;
+    return 0;
+  }
+  uint32_t *hist = mem;
+  uint16_t *rowLut = (uint16_t *)(hist + (size_t)tx * 256);
+  int *colTile = (int *)(rowLut + (size_t)tx * 256);
+  int *colWt = colTile + w;
+  int *rowTile = colWt + w;
+  int *rowWt = rowTile + h;
+  uint8 *lut = (uint8 *)(rowWt + h);
+  claheWeights(w, tx, colTile, colWt);
+  claheWeights(h, ty, rowTile, rowWt);
+
+  // The tiles are independent: histograms of a row of tiles are counted
+  // together, a row of pixels at a time.
+  for (int j = 0; j < ty; j++) {
+    int y0 = (int)((int64_t)j * h / ty);
+    int y1 = (int)((int64_t)(j + 1) * h / ty);
+    memset(hist, 0, (size_t)tx * 256 * sizeof(uint32_t));
+    for (int y = y0; y < y1; y++) {
+      const uint8 *p = img->pixel + (size_t)y * w;
+      for (int i = 0; i < tx; i++) {
+        uint32_t *th = hist + (size_t)i * 256;
+        int x1 = (int)((int64_t)(i + 1) * w / tx);
+        for (int x = (int)((int64_t)i * w / tx); x < x1; x++)
+          th[p[x]]++;
+      }
+    }
+    for (int i = 0; i < tx; i++) {
+      uint32_t n = (uint32_t)(y1 - y0) *
+                   (uint32_t)((int64_t)(i + 1) * w / tx - (int64_t)i * w / tx);
+      claheLut(hist + (size_t)i * 256, n, clip, img->maxval,
+               lut + ((size_t)j * tx + i) * 256);
+    }
+  }
+  PIXMEM += (unsigned long)w * h;
+
+  for (int y = 0; y < h; y++) {
+    // Blend the LUTs of the two rows of tiles (16-bit fixed point).
+    const uint8 *top = lut + (size_t)rowTile[y] * tx * 256;
+    const uint8 *bot = rowWt[y] > 0 ? top + (size_t)tx * 256 : top;
+    int wb = rowWt[y];
+    size_t m = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vwt = _mm_set1_epi16((short)(256 - wb));
+    const __m128i vwb = _mm_set1_epi16((short)wb);
+    for (; m + 16 <= (size_t)tx * 256; m += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(top + m));
+      __m128i b = _mm_loadu_si128((const __m128i *)(bot + m));
+      __m128i lo = _mm_add_epi16(
+          _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), vwt),
+          _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), vwb));
+      __m128i hi = _mm_add_epi16(
+          _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), vwt),
+          _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), vwb));
+      _mm_storeu_si128((__m128i *)(rowLut + m), lo);
+      _mm_storeu_si128((__m128i *)(rowLut + m + 8), hi);
+    }
+#endif
+    for (; m < (size_t)tx * 256; m++)
+      rowLut[m] = (uint16_t)(top[m] * (256 - wb) + bot[m] * wb);
+
+    // Then blend horizontally, per pixel.
+    uint8 *p = img->pixel + (size_t)y * w;
+    for (int x = 0; x < w; x++) {
+      const uint16_t *l = rowLut + (size_t)colTile[x] * 256 + p[x];
+      uint32_t a = l[0];
+      uint32_t b = colWt[x] > 0 ? l[256] : a;
+      p[x] = (uint8)((a * (256 - colWt[x]) + b * colWt[x] + 32768) >> 16);
+    }
+  }
+  PIXMEM += (unsigned long)w * h;
+
+  free(mem);
+  return 1;
+}
+
+// Size of the bands (or file chunks) that ImageNormalize works on: small
+// enough to stay in a typical L2 cache.
+#define NORM_BAND (256 * 1024)
+
+// Fill lut with the linear map of [lo, hi] onto [0, maxval], clamped.
+static void normalizeLut(uint8 lo, uint8 hi, uint8 maxval, uint8 lut[256]) {
+  int den = hi - lo;
+  for (int l = 0; l < 256; l++) {
+    int num = l <= lo ? 0 : l >= hi ? den * maxval : (l - lo) * maxval;
+    lut[l] = den > 0 ? (uint8)((num + den / 2) / den) : (uint8)l;
+  }
+}
+
+/// Stretch the contrast of an image to the full range.
+int ImageNormalize(Image img) { ///
+  assert(img != NULL);
+  if (!willChange(img, 0, 0, img->width, img->height))
+    return 0;
+  size_t size = (size_t)img->width * img->height;
+  if (size == 0)
+    return 1;
+  // First pass over bands, in order, for the range; second pass in
+  // reverse order, so the last bands read are remapped while still cached.
+  size_t bands = (size - 1) / NORM_BAND + 1;
+  uint8 lo, hi;
+  minMax(img->pixel, size < NORM_BAND ? size : NORM_BAND, &lo, &hi);
+  for (size_t b = 1; b < bands; b++) {
+    size_t n = b + 1 < bands ? NORM_BAND : size - b * NORM_BAND;
+    uint8 blo, bhi;
+    minMax(img->pixel + b * NORM_BAND, n, &blo, &bhi);
+    lo = blo < lo ? blo : lo;
+    hi = bhi > hi ? bhi : hi;
+  }
+  PIXMEM += (unsigned long)size;
+  if (lo == hi)
+    return 1; // flat image
+  uint8 lut[256];
+  normalizeLut(lo, hi, img->maxval, lut);
+  for (size_t b = bands; b-- > 0;) {
+    size_t n = b + 1 < bands ? NORM_BAND : size - b * NORM_BAND;
+    applyLut(img->pixel + b * NORM_BAND, n, lut);
+  }
+  PIXMEM += (unsigned long)size;
+  return 1;
+}
+
+/// Stretch the contrast of a PGM file to the full range, into another file.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageNormalizeFile(const char *infile, const char *outfile) { ///
+  assert(infile != NULL && outfile != NULL);
+  int w, h;
+  int maxval;
+  FILE *in = NULL;
+  FILE *out = NULL;
+  uint8 *buf = NULL;
+  long start = -1;
+
+  int success = check((in = fopen(infile, "rb")) != NULL, "Open failed") &&
+                readHeader(in, &w, &h, &maxval) &&
+                check((start = ftell(in)) >= 0, "Seek failed") &&
+                check((buf = malloc(NORM_BAND)) != NULL, "Out of memory");
+
+  // First pass: the range of levels.
+  size_t size = (size_t)w * h;
+  size_t n;
+  uint8 lo = (uint8)maxval;
+  uint8 hi = 0;
+  for (size_t done = 0; success && done < size; done += n) {
+    n = size - done < NORM_BAND ? size - done : NORM_BAND;
+    success = check(fread(buf, sizeof(uint8), n, in) == n, "Reading pixels");
+    if (success) {
+      uint8 blo, bhi;
+      minMax(buf, n, &blo, &bhi);
+      lo = blo < lo ? blo : lo;
+      hi = bhi > hi ? bhi : hi;
+    }
+  }
+  PIXMEM += (unsigned long)size;
+
+  // Second pass: remap and write.
+  uint8 lut[256];
+  if (lo >= hi)
+    lo = hi = 0; // empty or flat image: unchanged
+  normalizeLut(lo, hi, (uint8)maxval, lut);
+  success = success && check(fseek(in, start, SEEK_SET) == 0, "Seek failed") &&
+            check((out = fopen(outfile, "wb")) != NULL, "Open failed") &&
+            check(fprintf(out, "P5\n%d %d\n%u\n", w, h, maxval) > 0,
+                  "Writing header failed");
+  for (size_t done = 0; success && done < size; done += n) {
+    n = size - done < NORM_BAND ? size - done : NORM_BAND;
+    success = check(fread(buf, sizeof(uint8), n, in) == n, "Reading pixels");
+    if (success) {
+      applyLut(buf, n, lut);
+      success = check(fwrite(buf, sizeof(uint8), n, out) == n,
+                      "Writing pixels failed");
+    }
+  }
+  PIXMEM += (unsigned long)size;
+
+  // Cleanup
+  free(buf);
+  if (in != NULL)
+    fclose(in);
+  if (out != NULL)
+    success = check(fclose(out) == 0, "Writing pixels failed") && success;
+  return success;
 }
@@ -13,6 +13,7 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -51,6 +52,30 @@ void ImageInit(void) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) ;
 
+/// Create a new image with undefined pixels.
+/// Same as ImageCreate, but the pixels are not cleared: this saves a pass
+/// over the whole buffer (and, for a buffer reused from the image pool,
+/// writing it twice).  The pixels may hold anything, including data from
+/// destroyed images, so the caller must set every pixel before reading it.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateUninit(int width, int height, uint8 maxval) ;
+
+/// Clone an image.
+/// The clone shares the pixels of img, until either image is changed:
+/// then (and only then) the changed one gets its own copy of the pixels.
+/// Cloning is cheap, and so is keeping an original image next to a
+/// processed version of it, as long as one of them is only read.
+/// The operations that change images in-place may then need to allocate
+/// memory, once, and fail for lack of it (see Pixel transformations).
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) ;
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -58,6 +83,90 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Huge pages
+
+/// The pixels of large images (2 MB or more) may be mapped on 2 MB pages,
+/// so that sweeping them takes far fewer TLB misses.
+/// Transparent huge pages are provided by the kernel if enabled (in
+/// "always" or "madvise" mode); explicit ones must be reserved beforehand
+/// (vm.nr_hugepages), and if none are left, transparent ones are used.
+/// Huge pages are only available on Linux; elsewhere, malloc is used.
+
+/// Allocation policies for pixel buffers.
+typedef enum {
+  ALLOC_MALLOC,  ///< Plain malloc/calloc (the default)
+  ALLOC_THP,     ///< Mapping aligned on 2 MB, with madvise(MADV_HUGEPAGE)
+  ALLOC_HUGETLB, ///< Explicit huge pages, with mmap(MAP_HUGETLB)
+} AllocPolicy;
+
+/// Set the allocation policy for the pixels of new images.
+/// This applies to all images created from then on, including those
+/// created by operations (ImageCreateAlloc overrides it for one image).
+/// Returns the previous policy.
+AllocPolicy ImageSetAllocPolicy(AllocPolicy policy) ;
+
+/// Create a new black image, with pixels allocated following policy.
+/// Same as ImageCreate, but with the allocation policy for this image only.
+Image ImageCreateAlloc(int width, int height, uint8 maxval,
+                       AllocPolicy policy) ;
+
+/// Image pool
+
+/// Destroyed images may be kept in a pool, with their pixel buffers, to be
+/// reused by later image creations of a similar size (free lists by size
+/// class, 4 classes per power of two).  This avoids mapping, faulting in and
+/// unmapping large buffers again and again, in long pipelines.
+/// Reused buffers are cleared only when needed: ImageCreate still returns a
+/// black image, but ImageCreateUninit and the operations that overwrite
+/// every pixel skip the clearing.
+
+/// Set the image pool limit.
+/// Destroyed images are kept for reuse while the pool holds at most
+/// limit bytes of pixels; cached images beyond a lowered limit are freed.
+/// A limit of 0 (the default) turns pooling off.
+void ImagePoolSetLimit(size_t limit) ;
+
+/// Image pool statistics.
+/// Sets (*requests) to the number of images created so far, (*hits) to
+/// how many of those reused a pooled buffer, and (*footprint) and (*peak)
+/// to the current and maximum bytes of pixel buffers, live or pooled.
+void ImagePoolStats(uint64_t* requests, uint64_t* hits, size_t* footprint,
+                    size_t* peak) ;
+
+/// Dirty rectangles
+
+/// Every operation that changes the pixels of an image records the
+/// rectangle it changed, so that results derived from the image (blurred
+/// copies, integral images, histograms) can be brought up to date over
+/// that rectangle only (plus the reach of the filter, if any), instead of
+/// being computed again.  Rectangles that overlap or touch are coalesced,
+/// and at most 8 are kept: past that, a new one is merged with the one it
+/// grows the least.
+/// Whole-image operations (filters, point operations) dirty the whole
+/// image; ImageSetPixel, ImagePaste, ImagePasteRect and ImageBlend only the
+/// pixels they change.  New images have no dirty rectangles.
+///
+/// Typical use:
+///   blurred = clone of img, blurred (for instance)
+///   ImageDirtyClear(img);
+///   ... ImagePaste(img, x, y, patch) ...
+///   ImageBlurUpdate(img, blurred, dx, dy);
+///   ImageDirtyClear(img);
+/// Updates do not clear the rectangles, so that several derived results
+/// may be brought up to date before the client clears them.
+
+/// Number of dirty rectangles of img.
+/// Together, they cover every pixel changed since the last ImageDirtyClear
+/// (or since img was created).
+int ImageDirtyCount(Image img) ;
+
+/// Get dirty rectangle i of img, for 0 <= i < ImageDirtyCount(img).
+/// On return, (*x, *y, *w, *h) is set to the rectangle.
+void ImageDirtyRect(Image img, int i, int* x, int* y, int* w, int* h) ;
+
+/// Clear the dirty rectangles of img.
+void ImageDirtyClear(Image img) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
@@ -93,6 +202,20 @@ int ImageMaxval(Image img) ;
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Pixel histogram
+/// On return, hist[l] is set to the number of pixels with gray level l,
+/// for each l in 0..255.
+/// Counts go to several interleaved sub-histograms, which are merged at
+/// the end, so runs of equal levels do not serialize the increments.
+void ImageHistogram(Image img, uint32_t hist[256]) ;
+
+/// Mean and standard deviation of the gray levels counted in hist
+/// (as filled by ImageHistogram).
+/// On return, *mean and *stddev are set (both to 0, if hist is empty).
+/// The standard deviation is that of the population (divided by N).
+void ImageHistogramMoments(const uint32_t hist[256], double* mean,
+                           double* stddev) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -110,30 +233,35 @@ int ImageValidRect(Image img, int x, int y, int w, int h) ;
 uint8 ImageGetPixel(Image img, int x, int y) ;
 
 /// Set the pixel at position (x,y) to new level.
-void ImageSetPixel(Image img, int x, int y, uint8 level) ;
+/// Fails only as the pixel transformations below do.
+int ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place: no allocation involved,
+/// except for a copy of the pixels if they are shared with a clone (see
+/// ImageClone).  They only fail if that copy cannot be allocated.
+/// On success, they return nonzero.
+/// On failure, they return 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) ;
+int ImageNegative(Image img) ;
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) ;
+int ImageThreshold(Image img, uint8 thr) ;
 
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) ;
+int ImageBrighten(Image img, double factor) ;
 
 /// Geometric transformations
 
@@ -181,17 +309,26 @@ Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place (see Pixel transformations).
 /// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) ;
+int ImagePaste(Image img1, int x, int y, Image img2) ;
+
+/// Paste a rectangle of an image into another image.
+/// Paste the rectangle (x2, y2, w, h) of img2 into position (x, y) of img1.
+/// Rows are copied whole, so this is much faster than pasting a crop.
+/// This modifies img1 in-place (see Pixel transformations).
+/// Requires: the rectangle is inside img2, and fits inside img1 at (x, y);
+/// img1 and img2 are different images.
+int ImagePasteRect(Image img1, int x, int y, Image img2, int x2, int y2,
+                   int w, int h) ;
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place (see Pixel transformations).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
+int ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
@@ -204,12 +341,481 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Compare an image to a subimage of a larger image, with tolerance.
+/// Returns 1 (true) if no pixel of img2 differs by more than tol from the
+/// corresponding pixel of the subimage of img1 at pos (x, y).
+/// Returns 0, otherwise.
+/// Requires: img2 fits inside img1 at pos (x, y).
+int ImageMatchSubImageTol(Image img1, int x, int y, Image img2, uint8 tol) ;
+
+/// Locate a subimage inside another image, with tolerance.
+/// Same as ImageLocateSubImage, but matching with ImageMatchSubImageTol.
+int ImageLocateSubImageTol(Image img1, int* px, int* py, Image img2,
+                           uint8 tol) ;
+
+/// Locate several subimages inside another image, in a single pass.
+/// Searches for each of the n images img2[0..n-1] inside img1.
+/// Uses the Baker-Bird algorithm: rows of the subimages are matched by an
+/// Aho-Corasick automaton and columns of row ids by a second automaton,
+/// so img1 is scanned only once, whatever n is.
+/// Requires: all img2[i] have the same width and height and fit inside img1.
+/// On return, (px[i], py[i]) is set to the first matching position of
+/// img2[i] (in the same order as ImageLocateSubImage would find it),
+/// or to (-1, -1) if img2[i] was not found.
+/// Returns the number of subimages found, or -1 on failure
+/// (errno/errCause are set accordingly).
+int ImageLocateSubImages(Image img1, int n, Image img2[], int px[], int py[]) ;
+
+/// Locate a subimage inside another image, in any of 8 orientations.
+/// Searches for img2, and its rotations and mirror images, inside img1,
+/// checking all of them at each position of a single traversal of img1.
+/// The orientation of a match is a number o such that img2, mirrored if
+/// o >= 4 (as by ImageMirror), and then rotated (o % 4) times (as by
+/// ImageRotate), matches img1 at that position.
+/// Orientations where img2 does not fit inside img1 are not searched.
+/// If a match is found, returns 1, the first matching position (in raster
+/// order) is set in (*px, *py), and its orientation in *po (the lowest
+/// one, if several orientations match there).
+/// If no match is found, returns 0 and (*px, *py, *po) are left untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateSubImageOriented(Image img1, int* px, int* py, int* po,
+                                Image img2) ;
+
+/// Similarity measures for approximate matching.
+typedef enum {
+  MATCH_SAD, ///< Sum of absolute differences (lower is better)
+  MATCH_SSD, ///< Sum of squared differences (lower is better)
+  MATCH_NCC, ///< Normalized cross-correlation, in [-1, 1] (higher is better)
+} MatchMetric;
+
+/// Locate the best approximate match of a subimage inside another image.
+/// Compares img2 with every subimage of img1 where it fits, using the given
+/// metric, and sets (*px, *py) to the best position (the first one, in
+/// raster order, in case of ties) and *score to its score.
+/// Small problems are solved directly (with SIMD kernels, when available);
+/// large ones compute the cross-correlation by FFT, as chosen by a cost
+/// model based on the sizes of both images.  MATCH_SAD is always direct.
+/// For MATCH_NCC, a flat window vs a flat img2 scores 1, and a flat window
+/// vs a non-flat img2 (or vice-versa) scores 0.
+/// Requires: img2 fits inside img1.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageLocateBestMatch(Image img1, int* px, int* py, Image img2,
+                         MatchMetric metric, double* score) ;
+
+/// Image pyramids
+
+// Type ImagePyramid is a pointer to image pyramid objects
+typedef struct imagePyramid *ImagePyramid;
+
+/// Create an image pyramid for img.
+/// Level 0 is img itself (not a copy!), and each further level is a 2x
+/// box-downsampled version of the previous one (odd last rows/columns are
+/// dropped).  If levels <= 0, levels are added while both dimensions are
+/// at least 8.
+/// Requires: img must not be modified or destroyed while the pyramid is
+/// in use.
+///
+/// On success, a new pyramid is returned.
+/// (The caller is responsible for destroying the returned pyramid!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImagePyramid ImagePyramidCreate(Image img, int levels) ;
+
+/// Destroy the pyramid pointed to by (*pyrp).
+/// The level 0 image is not destroyed.
+/// If (*pyrp)==NULL, no operation is performed.
+/// Ensures: (*pyrp)==NULL.
+void ImagePyramidDestroy(ImagePyramid* pyrp) ;
+
+/// Get the number of levels in pyramid.
+int ImagePyramidLevels(ImagePyramid pyr) ;
+
+/// Locate a subimage inside an image, using its pyramid.
+/// Searches img2 at the coarsest usable level by SAD, keeps the best
+/// k candidates, and refines only their neighbourhoods at each finer level.
+/// At level 0, candidates are verified with ImageMatchSubImage semantics,
+/// but allowing each pixel to differ by up to tol (tol=0 is exact).
+/// Because coarse levels only approximate the match, a subimage may be
+/// missed if it is not among the k best candidates at some level; a larger
+/// k (default 16, if k <= 0) trades speed for robustness.
+/// Pyramids may be reused to search several subimages, amortizing their
+/// construction.
+/// Requires: img2 fits inside the level 0 image.
+/// If a match is found, returns 1 and the matching position (the first
+/// one in raster order among the verified candidates) is set in (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImagePyramidLocate(ImagePyramid pyr, int* px, int* py, Image img2,
+                       uint8 tol, int k) ;
+
+/// Block-hash indexes
+
+// Type ImageIndex is a pointer to image index objects
+typedef struct imageIndex *ImageIndex;
+
+/// Create a block-hash index for img.
+/// The index stores a hash of the bw x bh block at every position of img,
+/// in an open-addressing hash table, so that subimages can then be located
+/// by looking up a single block, and verifying only the positions found.
+/// Requires: 1 <= bw <= width of img, 1 <= bh <= height of img.
+/// Requires: img must not be modified or destroyed while the index is
+/// in use.
+///
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexCreate(Image img, int bw, int bh) ;
+
+/// Destroy the index pointed to by (*idxp).
+/// The indexed image is not destroyed.
+/// If (*idxp)==NULL, no operation is performed.
+/// Ensures: (*idxp)==NULL.
+void ImageIndexDestroy(ImageIndex* idxp) ;
+
+/// Load an index of img from a file (written by ImageIndexSave).
+/// The file is rejected if it was not built for an image with the same
+/// size and pixels as img.
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexLoad(const char* filename, Image img) ;
+
+/// Save index to a file.
+/// The file format is binary, in the byte order of the machine.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageIndexSave(ImageIndex idx, const char* filename) ;
+
+/// Locate a subimage inside the indexed image.
+/// Requires: img2 fits inside the indexed image and is at least as large
+/// as the index blocks.
+/// If a match is found, returns 1 and matching position is set in vars
+/// (*px, *py), as ImageLocateSubImage would.
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int ImageIndexLocate(ImageIndex idx, int* px, int* py, Image img2) ;
+
+/// Get the block width of index.
+int ImageIndexBlockWidth(ImageIndex idx) ;
+
+/// Get the block height of index.
+int ImageIndexBlockHeight(ImageIndex idx) ;
+
+/// Integral images
+
+// Type IntegralImage is a pointer to integral image objects
+typedef struct integralImage *IntegralImage;
+
+/// Create the integral image (summed-area table) of img.
+/// The sums are kept in 64-bit accumulators, so any image size is fine.
+/// If squares is nonzero, sums of squared levels are also kept, which
+/// IntegralImageRectSumSq and IntegralImageRectVariance require.
+/// The integral image is a snapshot: later changes to img do not affect it.
+/// Build once, then query any rectangle in O(1).
+/// On success, a new integral image is returned.
+/// (The caller is responsible for destroying the returned integral image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+IntegralImage IntegralImageCreate(Image img, int squares) ;
+
+/// Destroy the integral image pointed to by (*iip).
+/// If (*iip)==NULL, no operation is performed.
+/// Ensures: (*iip)==NULL.
+void IntegralImageDestroy(IntegralImage* iip) ;
+
+/// Get the width of the image that ii was built from.
+int IntegralImageWidth(IntegralImage ii) ;
+
+/// Get the height of the image that ii was built from.
+int IntegralImageHeight(IntegralImage ii) ;
+
+/// Rectangle queries.
+/// The rectangle (x, y, w, h) must be inside the image that ii was built
+/// from; mean and variance also require a non-empty rectangle.
+/// The SumSq and Variance queries require an integral image with squares.
+uint64_t IntegralImageRectSum(IntegralImage ii, int x, int y, int w, int h) ;
+uint64_t IntegralImageRectSumSq(IntegralImage ii, int x, int y, int w, int h) ;
+double IntegralImageRectMean(IntegralImage ii, int x, int y, int w, int h) ;
+double IntegralImageRectVariance(IntegralImage ii, int x, int y, int w,
+                                 int h) ;
+
+/// Bring the integral image of img up to date, after img was changed.
+/// Only the sums that include dirty pixels (those below and right of the
+/// top left corner of the dirty rectangles) are computed again.
+/// Requires: ii was built from img, as it was when its dirty rectangles
+/// were last cleared.
+void IntegralImageUpdate(IntegralImage ii, Image img) ;
+
+/// Band histograms
+
+/// A band histogram keeps the histogram of each band of 32 rows of an
+/// image, so that the histogram of the whole image (and the stats that
+/// derive from it: range, mean, standard deviation) can be brought up to
+/// date after changes, by counting the bands with dirty pixels only.
+
+// Type BandHistogram is a pointer to band histogram objects
+typedef struct bandHistogram *BandHistogram;
+
+/// Create the band histogram of img.
+/// On success, a new band histogram is returned.
+/// (The caller is responsible for destroying it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BandHistogram BandHistogramCreate(Image img) ;
+
+/// Destroy the band histogram pointed to by (*bhp).
+/// If (*bhp)==NULL, no operation is performed.
+/// Ensures: (*bhp)==NULL.
+void BandHistogramDestroy(BandHistogram* bhp) ;
+
+/// Bring the band histogram of img up to date, after img was changed.
+/// Requires: bh was built from img, as it was when its dirty rectangles
+/// were last cleared.
+void BandHistogramUpdate(BandHistogram bh, Image img) ;
+
+/// Get the histogram of the image, as kept in bh (see ImageHistogram).
+void BandHistogramGet(BandHistogram bh, uint32_t hist[256]) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) ;
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+int ImageBlur(Image img, int dx, int dy) ;
+
+/// Bring a blurred copy of an image up to date, after the image changed.
+/// Only the pixels of blurred within (dx, dy) of the dirty rectangles of
+/// img are computed again, from a crop of img around them.
+/// Requires: blurred is a copy of img blurred with ImageBlur(dx, dy), as
+/// img was when its dirty rectangles were last cleared.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageBlurUpdate(Image img, Image blurred, int dx, int dy) ;
+
+/// Blur an image with an approximate Gaussian filter of deviation sigma.
+/// The filter is a cascade of 3 mean filters (as in ImageBlur, including
+/// the handling of borders), with sizes chosen so that their combined
+/// variance matches sigma^2.  The cost does not depend on sigma.
+/// The image is changed in-place.
+/// Requires: sigma >= 0.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+int ImageGaussianBlur(Image img, double sigma) ;
+
+/// Local threshold rules for ImageThresholdAdaptive.
+typedef enum {
+  THR_SAUVOLA, ///< mean * (1 + k * (stddev / R - 1)), R = (maxval+1)/2
+  THR_BRADLEY, ///< mean * (1 - k)
+} ThresholdMethod;
+
+/// Apply an adaptive threshold to an image.
+/// Each pixel is compared with a threshold computed from the mean (and,
+/// for THR_SAUVOLA, the standard deviation) of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image, as in ImageBlur), and
+/// set as in ImageThreshold: to 0 if its level is below the threshold, or
+/// to maxval otherwise.  This copes with uneven lighting, unlike a global
+/// threshold.  Typical values of k are 0.2..0.5 for THR_SAUVOLA, and
+/// about 0.15 for THR_BRADLEY.
+/// The sums and squared sums of the windows are updated incrementally, in
+/// a single pass that keeps only 2dy+1 rows of them, so the cost per pixel
+/// does not grow with dx and dy.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+int ImageThresholdAdaptive(Image img, int dx, int dy, double k,
+                           ThresholdMethod method) ;
+
+/// Apply a (2dx+1)x(2dy+1) median filter to an image.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image, as in ImageBlur).
+/// For an even number of pixels, the lower of the two middle levels is used.
+/// Uses column histograms and a sliding window histogram with coarse and
+/// fine bins, so the cost per pixel does not grow with dx and dy.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Blur an image using an integral image of it.
+/// Same as ImageBlur, but img is overwritten with the blur of the image
+/// that ii was built from (usually img itself, or a copy of it).
+/// This allows several blurs of the same image to share a single
+/// integral image.
+/// Requires: img has the same dimensions as the image ii was built from.
+/// Fails only as the pixel transformations do.
+int ImageBlurIntegral(Image img, IntegralImage ii, int dx, int dy) ;
+
+/// Blur an image with n filter sizes at once.
+/// out[k] is set to a new image with the blur of img using a
+/// (2dx[k]+1)x(2dy[k]+1) mean filter, as ImageBlur would compute it.
+/// A single integral image of img is built, and all outputs are written
+/// in one sweep over it.
+/// Ensures: The original img is not modified.
+/// On success, returns nonzero.
+/// (The caller is responsible for destroying the n returned images!)
+/// On failure, returns 0, out[0..n-1] are set to NULL, and errno/errCause
+/// are set accordingly.
+int ImageBlurMulti(Image img, int n, const int dx[], const int dy[],
+                   Image out[]) ;
+
+/// Morphology
+
+/// These filters use a (2dx+1)x(2dy+1) rectangular structuring element,
+/// clipped to the image (as in ImageBlur), and change the image in-place.
+/// They are separable, and each 1D pass uses the van Herk/Gil-Werman
+/// algorithm: about 3 min/max operations per pixel, for any window size.
+/// The vertical passes process strips of 1024 columns, a row of the strip
+/// at a time (with SIMD, when available), so their scratch memory is that
+/// of a strip, not of the whole image.
+/// On success, they return nonzero.
+/// On failure, they return 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+
+/// Erode an image: each pixel is substituted by the minimum of the pixels
+/// in the rectangle [x-dx, x+dx]x[y-dy, y+dy].
+int ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate an image: each pixel is substituted by the maximum of the pixels
+/// in the rectangle [x-dx, x+dx]x[y-dy, y+dy].
+int ImageDilate(Image img, int dx, int dy) ;
+
+/// Open an image: erosion followed by dilation.
+/// Removes bright details smaller than the structuring element.
+int ImageOpen(Image img, int dx, int dy) ;
+
+/// Close an image: dilation followed by erosion.
+/// Removes dark details smaller than the structuring element.
+int ImageClose(Image img, int dx, int dy) ;
+
+/// Convolution
+
+// Type ConvKernel is a pointer to convolution kernel objects
+typedef struct convKernel *ConvKernel;
+
+/// How convolution handles kernel taps that fall outside the image.
+typedef enum {
+  CONV_REPLICATE, ///< Use the nearest pixel of the image
+  CONV_SHRINK,    ///< Drop them, and rescale (as ImageBlur does)
+} ConvEdge;
+
+/// Create a w x h convolution kernel.
+/// The result of a convolution is sum(coef[j*w+i] * pixel) / div, rounded
+/// to the nearest integer and clamped to [0, maxval].
+/// Kernels of rank 1 (such as box, binomial or Sobel filters) are detected
+/// and applied as two 1D passes.
+/// Requires: w and h are odd, div > 0, coefficients fit in 16 bits, and
+/// 255 times the sum of their absolute values fits in 32 bits.
+/// On success, a new kernel is returned.
+/// (The caller is responsible for destroying the returned kernel!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ConvKernel ConvKernelCreate(int w, int h, const int coef[], int div) ;
+
+/// Destroy the kernel pointed to by (*kp).
+/// If (*kp)==NULL, no operation is performed.
+/// Ensures: (*kp)==NULL.
+void ConvKernelDestroy(ConvKernel* kp) ;
+
+/// Check if kernel is applied as two 1D passes.
+int ConvKernelSeparable(ConvKernel k) ;
+
+/// Convolve an image with a kernel.
+/// The kernel is centered on each pixel, and taps outside the image are
+/// handled according to edge.  With CONV_SHRINK, the sum over the taps
+/// inside is rescaled by (sum of all coefficients)/(sum of those inside),
+/// unless either is zero, so a box kernel gives the same result as
+/// ImageBlur.
+/// Products are computed with 16-bit SIMD multiply-accumulates (when
+/// available), one row at a time over a ring of kernel-height rows.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+int ImageConvolve(Image img, ConvKernel k, ConvEdge edge) ;
+
+/// Edge detection
+
+/// Compute the gradient magnitude of an image (Sobel operator).
+/// Each pixel is substituted by sqrt(gx^2 + gy^2), rounded and saturated
+/// at maxval, where gx and gy are the horizontal and vertical 3x3 Sobel
+/// derivatives (with borders replicated).
+/// If dir is not NULL, it is set to the direction of the gradient:
+/// atan2(gy, gx) (with y growing downwards), as a fraction of a full turn
+/// in [0, 1), scaled to levels 0..maxval of dir (maxval+1 steps).
+/// Derivatives are computed in 16 bits (with SIMD, when available).
+/// The image is changed in-place.
+/// Requires: dir is NULL or has the same size as img.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+int ImageSobel(Image img, Image dir) ;
+
+/// Detect edges in an image (Canny).
+/// The image is smoothed with ImageGaussianBlur(img, sigma) (if sigma>0),
+/// then the pixels where the Sobel gradient magnitude is a local maximum
+/// along the gradient direction (non-maximum suppression) and at least low
+/// are kept, if they are connected to one whose magnitude is at least high
+/// (hysteresis).
+/// Magnitudes are as in ImageSobel, before rounding (up to 1443).
+/// Edges are set to maxval, and all other pixels to 0.
+/// The image is changed in-place.
+/// Requires: sigma >= 0 and 0 <= low <= high.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+int ImageCanny(Image img, double sigma, int low, int high) ;
+
+/// Contrast enhancement
+
+/// Equalize the histogram of an image.
+/// Each level l is mapped so that the levels present spread over the full
+/// range: the lowest one to 0, the highest to maxval, and the others in
+/// proportion to the number of pixels at or below them (cumulative
+/// histogram).  An image with a single level is left unchanged.
+/// The image is changed in-place, with a single lookup table.
+/// Fails only as the pixel transformations do.
+int ImageEqualize(Image img) ;
+
+/// Apply contrast-limited adaptive histogram equalization (CLAHE).
+/// The image is split in tx x ty tiles, and each tile gets its own
+/// equalization table, from its histogram with counts clipped at clip
+/// times their mean (and the excess spread over all levels), which limits
+/// the amplification of noise.  Each pixel is then mapped with a bilinear
+/// interpolation of the tables of the (up to 4) tiles whose centers are
+/// nearest, so there are no seams between tiles.
+/// Tables are computed independently for each tile; the interpolation is
+/// done in fixed point, blending the tables of two rows of tiles for each
+/// image row (with SIMD, when available) and then two entries per pixel.
+/// The image is changed in-place.
+/// Requires: 1 <= tx <= width, 1 <= ty <= height, clip >= 1.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+int ImageCLAHE(Image img, int tx, int ty, double clip) ;
+
+/// Stretch the contrast of an image to the full range.
+/// Levels are mapped linearly so that the minimum level in the image
+/// becomes 0 and the maximum becomes maxval (rounding to nearest).
+/// An image with a single level is left unchanged.
+/// The range is found over bands of the image that fit in cache, and the
+/// remapping then visits the bands in reverse order, so that the last ones
+/// read are still cached.
+/// The image is changed in-place.
+/// Fails only as the pixel transformations do.
+int ImageNormalize(Image img) ;
+
+/// Stretch the contrast of a PGM file to the full range, into another file.
+/// Same result as ImageLoad, ImageNormalize and ImageSave, but the image is
+/// never held in memory: the input file is streamed twice, in chunks of
+/// bounded size, first to find the range and then to remap and write it.
+/// Requires: infile and outfile are different files.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and a
+/// partial and invalid outfile may be left in the system.
+int ImageNormalizeFile(const char* infile, const char* outfile) ;
 
 #endif
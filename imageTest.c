@@ -18,6 +18,76 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Paste random crops of img into a clone of it, and check that a blurred
+// copy, an integral image and a band histogram of the clone, brought up to
+// date after each round of pastes, equal those computed again.
+// Returns 1 if they do, 0 if not, or -1 on failure (errno is set).
+static int checkUpdates(Image img, int rounds) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  int dx = w >= 5 ? 2 : 0;
+  int dy = h >= 5 ? 2 : 0;
+  Image cur = ImageClone(img);
+  Image blurred = ImageClone(img);
+  IntegralImage ii = cur != NULL ? IntegralImageCreate(cur, 0) : NULL;
+  BandHistogram bh = cur != NULL ? BandHistogramCreate(cur) : NULL;
+  int result = -1;
+  if (blurred != NULL && ii != NULL && bh != NULL &&
+      ImageBlur(blurred, dx, dy)) {
+    ImageDirtyClear(cur);
+    result = 1;
+  }
+  srand(2023);
+  for (int r = 0; result == 1 && r < rounds; r++) {
+    // Up to 12 pastes, so that dirty rectangles get merged too.
+    int pastes = 1 + rand() % 12;
+    for (int i = 0; result == 1 && i < pastes; i++) {
+      int pw = 1 + rand() % (w / 3 + 1);
+      int ph = 1 + rand() % (h / 3 + 1);
+      Image patch = ImageCrop(img, rand() % (w - pw + 1),
+                              rand() % (h - ph + 1), pw, ph);
+      if (patch == NULL || !ImagePaste(cur, rand() % (w - pw + 1),
+                                       rand() % (h - ph + 1), patch))
+        result = -1;
+      ImageDestroy(&patch);
+    }
+    if (result == 1 && !ImageBlurUpdate(cur, blurred, dx, dy))
+      result = -1;
+    if (result != 1)
+      break;
+    IntegralImageUpdate(ii, cur);
+    BandHistogramUpdate(bh, cur);
+    ImageDirtyClear(cur);
+
+    // Compute them again, and compare.
+    Image full = ImageClone(cur);
+    IntegralImage fii = IntegralImageCreate(cur, 0);
+    if (full == NULL || fii == NULL || !ImageBlur(full, dx, dy)) {
+      result = -1;
+    } else {
+      uint32_t hist[256];
+      uint32_t fhist[256];
+      BandHistogramGet(bh, hist);
+      ImageHistogram(cur, fhist);
+      result = ImageMatchSubImage(blurred, 0, 0, full) &&
+               memcmp(hist, fhist, sizeof(hist)) == 0;
+      for (int y = 1; result && y <= h; y++) {
+        for (int x = 1; result && x <= w; x++) {
+          result = IntegralImageRectSum(ii, 0, 0, x, y) ==
+                   IntegralImageRectSum(fii, 0, 0, x, y);
+        }
+      }
+    }
+    ImageDestroy(&full);
+    IntegralImageDestroy(&fii);
+  }
+  BandHistogramDestroy(&bh);
+  IntegralImageDestroy(&ii);
+  ImageDestroy(&blurred);
+  ImageDestroy(&cur);
+  return result;
+}
+
 int main(int argc, char *argv[]) {
   program_name = argv[0];
   if (argc != 3) {
@@ -48,6 +118,15 @@ int main(int argc, char *argv[]) {
     error(2, errno, "%s: %s", argv[2], ImageErrMsg());
   }
 
+  printf("# CHECK incremental updates\n");
+  int ok = checkUpdates(img1, 20);
+  if (ok < 0) {
+    error(2, errno, "Checking updates: %s", ImageErrMsg());
+  }
+  if (ok == 0) {
+    error(3, 0, "Incremental updates differ from computing them again");
+  }
+
   ImageDestroy(&img1);
   return 0;
 }
@@ -30,6 +30,8 @@ static const char *USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  The buffer grows as needed, and each image is released as soon as no\n"
+    "  later operation uses it.\n"
     "\n"
     "FILES:\n"
     "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
@@ -38,18 +40,44 @@ static const char *USAGE =
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
-    "  info            Show information on CURR (size and range)\n"
+    "  info            Show information on CURR (size, range, mean and "
+    "stddev)\n"
+    "  eager           Apply the following operations at once (by default,\n"
+    "                  chains of neg, thr, bri, crop, blur, median, erode,\n"
+    "                  dilate, open and close are deferred until another\n"
+    "                  operation needs the result, then computed in bands)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  pool MB         Keep up to MB megabytes of destroyed images for reuse\n"
+    "                  by later operations (0: no pooling, the default)\n"
+    "  mem             Print image pool hit rate and pixel memory footprint\n"
+    "  huge MODE       Allocate the pixels of the following images on 2 MB\n"
+    "                  pages: MODE is thp (transparent), explicit, or off\n"
     "\n"
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
+    "  thr adaptive DX,DY,K [METHOD]\n"
+    "                  Apply adaptive thresholding to CURR, with local\n"
+    "                  thresholds from (2DX+1)x(2DY+1) windows; METHOD is\n"
+    "                  sauvola (default) or bradley, with factor K\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "  norm            Stretch the levels of CURR to the full range\n"
+    "  normfile IN OUT Stretch the levels of PGM file IN to the full range,\n"
+    "                  streaming it into file OUT (does not use the buffer)\n"
+    "  eq              Equalize the histogram of CURR\n"
+    "  clahe TX,TY,CLIP\n"
+    "                  Apply contrast-limited adaptive histogram "
+    "equalization\n"
+    "                  to CURR, with TXxTY tiles, clipping counts at CLIP "
+    "(>=1)\n"
+    "                  times their mean\n"
     "\n"
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  clone           Clone CURR, creating new image that shares its pixels\n"
+    "                  until either one is changed\n"
     "\n"
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given "
@@ -57,16 +85,76 @@ static const char *USAGE =
     "\n"
     "  locate          Search PRED in CURR, print matching position, or "
     "NOTFOUND\n"
+    "  locate TOL      Same, allowing pixel differences up to TOL\n"
+    "  mlocate N       Search each of the N images before CURR in CURR "
+    "(single pass),\n"
+    "                  print matching positions, or NOTFOUND\n"
+    "  olocate         Search PRED in CURR in any of 8 orientations, print\n"
+    "                  matching position and orientation, or NOTFOUND\n"
+    "  match METRIC    Search best approximate match of PRED in CURR,\n"
+    "                  print position and score (METRIC: sad, ssd or ncc)\n"
+    "  plocate TOL     Search PRED in CURR, coarse-to-fine over an image "
+    "pyramid,\n"
+    "                  allowing pixel differences up to TOL, print matching "
+    "position,\n"
+    "                  or NOTFOUND\n"
+    "  index FILE      Load block-hash index of CURR from FILE, or build it\n"
+    "                  (with 8x8 blocks) and save it to FILE\n"
+    "  ilocate         Search PRED in CURR using the index of CURR, print\n"
+    "                  matching position, or NOTFOUND\n"
     "\n"
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  gauss SIGMA     blur CURR using approximate Gaussian filter\n"
+    "  median DX,DY    apply (2DX+1)x(2DY+1) median filter to CURR\n"
+    "  erode DX,DY     erode CURR (minimum filter) with (2DX+1)x(2DY+1) "
+    "rectangle\n"
+    "  dilate DX,DY    dilate CURR (maximum filter) with (2DX+1)x(2DY+1) "
+    "rectangle\n"
+    "  open DX,DY      open CURR (erode, then dilate)\n"
+    "  close DX,DY     close CURR (dilate, then erode)\n"
+    "  conv KERNEL [EDGE]\n"
+    "                  convolve CURR with KERNEL: box3, box5, gauss3, gauss5,\n"
+    "                  sharpen, laplace, sobelx, sobely, or W,H,DIV:C,C,...\n"
+    "                  (W*H coefficients, W and H odd, at most 9x9);\n"
+    "                  EDGE is shrink (default) or replicate\n"
+    "  sobel           replace CURR by its Sobel gradient magnitude\n"
+    "  canny SIGMA,LOW,HIGH\n"
+    "                  replace CURR by its Canny edges (Gaussian smoothing\n"
+    "                  SIGMA, hysteresis thresholds LOW, HIGH on magnitude)\n"
+    "  mblur R1,R2,... blur CURR using (2R+1)x(2R+1) mean filters for each "
+    "R,\n"
+    "                  in one pass -> one new image per R\n"
     "\n"
     "OPERANDS:\n"
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
+    "  orientation     o such that PRED, mirrored if o>=4, then rotated o%4 "
+    "times,\n"
+    "                  matches CURR\n"
     "  alpha           Blending factor\n"
+    "  TOL             Tolerance: maximum difference of gray levels "
+    "(0..255)\n"
     "\n";
 
+// Predefined convolution kernels, for the conv operation.
+static const struct {
+  const char *name;
+  int w, h, div;
+  int coef[25];
+} kernels[] = {
+    {"box3", 3, 3, 9, {1, 1, 1, 1, 1, 1, 1, 1, 1}},
+    {"box5", 5, 5, 25, {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+                        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1}},
+    {"gauss3", 3, 3, 16, {1, 2, 1, 2, 4, 2, 1, 2, 1}},
+    {"gauss5", 5, 5, 256, {1, 4,  6,  4,  1, 4, 16, 24, 16, 4, 6, 24, 36,
+                           24, 6, 4, 16, 24, 16, 4, 1, 4,  6,  4, 1}},
+    {"sharpen", 3, 3, 1, {0, -1, 0, -1, 5, -1, 0, -1, 0}},
+    {"laplace", 3, 3, 1, {0, 1, 0, 1, -4, 1, 0, 1, 0}},
+    {"sobelx", 3, 3, 1, {-1, 0, 1, -2, 0, 2, -1, 0, 1}},
+    {"sobely", 3, 3, 1, {-1, -2, -1, 0, 0, 0, 1, 2, 1}},
+};
+
 static char *errors[] = {
     "Success",
     "Insufficient operands",
@@ -76,8 +164,368 @@ static char *errors[] = {
     "Invalid operand",
     "Invalid rect (overflow)",
     "Invalid alpha",
+    "No index for CURR",
+};
+
+// Deferred execution
+//
+// Unless the eager operation is used, operations that act on each band of
+// rows independently (given enough neighbouring rows) are not applied at
+// once: they are queued as stages of a pending image, as is crop, and the
+// image is only computed when another operation needs it.  Then it is
+// computed band by band, each band going through all the stages while it
+// is in cache, instead of each stage streaming the whole image.
+
+// Rows per band: about this many bytes (but see materialize).
+#define BAND_BYTES (256 * 1024)
+
+// Maximum number of stages of a pending image.
+#define MAXSTAGES 16
+
+enum stageKind {
+  NEG,
+  THR,
+  BRI,
+  ADAPTIVE,
+  BLUR,
+  MEDIAN,
+  ERODE,
+  DILATE,
+  OPEN,
+  CLOSE,
+};
+
+// A deferred operation.
+struct stage {
+  enum stageKind kind;
+  int dx, dy;    // window radii, or level (THR, in dx)
+  double factor; // BRI and ADAPTIVE
+  ThresholdMethod method;
+};
+
+// A pending image: rectangle (x, y, w, h) of image src, through stages.
+struct pending {
+  int src; // -1 if not pending
+  int x, y, w, h;
+  int nstages;
+  struct stage stages[MAXSTAGES];
 };
 
+// Number of rows above and below a band that stage s needs.
+static int stageHalo(const struct stage *s) {
+  switch (s->kind) {
+  case NEG:
+  case THR:
+  case BRI:
+    return 0;
+  case OPEN:
+  case CLOSE:
+    return 2 * s->dy;
+  default:
+    return s->dy;
+  }
+}
+
+// Apply stage s to img.  Returns 0 on failure.
+static int runStage(Image img, const struct stage *s) {
+  switch (s->kind) {
+  case NEG:
+    return ImageNegative(img);
+  case THR:
+    return ImageThreshold(img, (uint8)s->dx);
+  case BRI:
+    return ImageBrighten(img, s->factor);
+  case ADAPTIVE:
+    return ImageThresholdAdaptive(img, s->dx, s->dy, s->factor, s->method);
+  case BLUR:
+    return ImageBlur(img, s->dx, s->dy);
+  case MEDIAN:
+    return ImageMedian(img, s->dx, s->dy);
+  case ERODE:
+    return ImageErode(img, s->dx, s->dy);
+  case DILATE:
+    return ImageDilate(img, s->dx, s->dy);
+  case OPEN:
+    return ImageOpen(img, s->dx, s->dy);
+  default:
+    return ImageClose(img, s->dx, s->dy);
+  }
+}
+
+// Compute pending image k, if it is pending.  Returns 0 on failure.
+// Each band is copied with the rows its stages need around it (its halo),
+// and the stages are applied to that copy.  Windows are clipped at its
+// edges, and only where it ends is the image, but the rows this affects
+// are in the halo, and dropped; so the result is the same as applying the
+// stages to the whole image.
+static int materialize(Image img[], struct pending pend[], int k) {
+  struct pending *p = &pend[k];
+  if (p->src < 0)
+    return 1;
+  Image src = img[p->src];
+  int w = p->w;
+  int h = p->h;
+  int halo = 0;
+  for (int i = 0; i < p->nstages; i++)
+    halo += stageHalo(&p->stages[i]);
+  // Bands are taller than their halos, so that each band copy is as tall
+  // as the windows of the stages (unless the image is not), and only
+  // overlaps the bands next to it.
+  int rows = w > 0 ? BAND_BYTES / w : h;
+  if (rows <= 2 * halo)
+    rows = 2 * halo + 1;
+  fprintf(stderr, "Computing I%d in %d band(s)\n", k,
+          h > 0 ? (h - 1) / rows + 1 : 0);
+
+  // An image with stages only is changed in-place, so the result of a
+  // band is only written after the next band (with its halo) is copied.
+  Image out = p->src == k ? src : ImageCreateUninit(w, h, ImageMaxval(src));
+  Image band[2] = {NULL, NULL};
+  int cur = 0;
+  // Rows [done, y0) of the result are in band[1 - cur], from row prev.
+  int done = 0;
+  int prev = 0;
+  int success = out != NULL;
+  for (int y0 = 0; success && y0 < h; y0 += rows) {
+    int y1 = y0 < h - rows ? y0 + rows : h;
+    int t0 = y0 > halo ? y0 - halo : 0;
+    int t1 = y1 < h - halo ? y1 + halo : h;
+    if (t1 - t0 <= 2 * halo) // the last band may be short: copy more rows
+      t0 = t1 > 2 * halo ? t1 - 2 * halo - 1 : 0;
+    if (band[cur] == NULL || ImageHeight(band[cur]) != t1 - t0) {
+      ImageDestroy(&band[cur]);
+      band[cur] = ImageCreateUninit(w, t1 - t0, ImageMaxval(src));
+      success = band[cur] != NULL;
+    }
+    if (success) {
+      success = ImagePasteRect(band[cur], 0, 0, src, p->x, p->y + t0, w,
+                               t1 - t0);
+      if (success && y0 > done)
+        success = ImagePasteRect(out, 0, done, band[1 - cur], 0, done - prev,
+                                 w, y0 - done);
+      for (int i = 0; success && i < p->nstages; i++)
+        success = runStage(band[cur], &p->stages[i]);
+      done = y0;
+      prev = t0;
+      cur = 1 - cur;
+    }
+  }
+  if (success && h > done)
+    success = ImagePasteRect(out, 0, done, band[1 - cur], 0, done - prev, w,
+                             h - done);
+  ImageDestroy(&band[0]);
+  ImageDestroy(&band[1]);
+  if (!success) {
+    if (out != src)
+      ImageDestroy(&out);
+    return 0;
+  }
+  img[k] = out;
+  p->src = -1;
+  return 1;
+}
+
+// Apply stage s to image k: at once if eager, else deferred.
+// Returns 0 on failure.
+static int defer(Image img[], struct pending pend[], int k, int eager,
+                 const struct stage *s) {
+  struct pending *p = &pend[k];
+  if (eager)
+    return runStage(img[k], s);
+  if (p->nstages == MAXSTAGES && !materialize(img, pend, k))
+    return 0;
+  if (p->src < 0) {
+    p->src = k;
+    p->x = p->y = 0;
+    p->w = ImageWidth(img[k]);
+    p->h = ImageHeight(img[k]);
+    p->nstages = 0;
+  }
+  p->stages[p->nstages++] = *s;
+  return 1;
+}
+
+// Check if operation op may be deferred (or does not need images).
+static int deferrable(const char *op) {
+  static const char *ops[] = {"neg",    "thr",    "bri",  "blur",
+                              "median", "erode",  "dilate", "open",
+                              "close",  "crop"};
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (strcmp(op, ops[i]) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Check if operation op changes the last image in-place.
+static int mutates(const char *op) {
+  static const char *ops[] = {"neg",   "thr",    "bri",   "blur",
+                              "gauss", "median", "erode", "dilate",
+                              "open",  "close",  "paste", "blend",
+                              "conv",  "sobel",  "canny", "eq",
+                              "clahe", "norm"};
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (strcmp(op, ops[i]) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Liveness
+
+// The operations, with the number of their mandatory operands, of the
+// images they use (the last ones in the buffer), and of the images they
+// create.  For thr, conv, locate, mlocate and mblur, these also depend on
+// the operands (see lastUses).  Any other argument is an image file, to
+// main and lastUses alike, so that they always agree on what creates
+// images.
+static const struct opInfo {
+  const char *name;
+  int operands;
+  int uses;
+  int creates;
+} opTable[] = {
+    {"tic", 0, 0, 0},      {"toc", 0, 0, 0},     {"eager", 0, 0, 0},
+    {"mem", 0, 0, 0},      {"pool", 1, 0, 0},    {"huge", 1, 0, 0},
+    {"info", 0, 1, 0},     {"neg", 0, 1, 0},     {"sobel", 0, 1, 0},
+    {"eq", 0, 1, 0},       {"norm", 0, 1, 0},    {"rotate", 0, 1, 1},
+    {"mirror", 0, 1, 1},   {"clone", 0, 1, 1},   {"olocate", 0, 2, 0},
+    {"ilocate", 0, 2, 0},  {"thr", 1, 1, 0},     {"conv", 1, 1, 0},
+    {"bri", 1, 1, 0},      {"blur", 1, 1, 0},    {"gauss", 1, 1, 0},
+    {"median", 1, 1, 0},   {"erode", 1, 1, 0},   {"dilate", 1, 1, 0},
+    {"open", 1, 1, 0},     {"close", 1, 1, 0},   {"canny", 1, 1, 0},
+    {"clahe", 1, 1, 0},    {"save", 1, 1, 0},    {"index", 1, 1, 0},
+    {"create", 1, 0, 1},   {"crop", 1, 1, 1},    {"paste", 1, 2, 0},
+    {"blend", 1, 2, 0},    {"match", 1, 2, 0},   {"plocate", 1, 2, 0},
+    {"locate", 0, 2, 0},   {"mlocate", 1, 1, 0}, {"mblur", 1, 1, 1},
+    {"normfile", 2, 0, 0},
+};
+
+// Find operation op in opTable.  Returns NULL if op is not an operation.
+static const struct opInfo *findOp(const char *op) {
+  for (size_t i = 0; i < sizeof(opTable) / sizeof(opTable[0]); i++) {
+    if (strcmp(op, opTable[i].name) == 0)
+      return &opTable[i];
+  }
+  return NULL;
+}
+
+// Find when each image is last used, ahead of time, by going over the
+// arguments as main does, but without images: last[i] is set to the index
+// in av of the last operation that uses image Ii (or creates it, if none
+// uses it).  Returns the number of images created, or -1 if not sure (for
+// invalid operands, for instance, which make main stop anyway).
+static int lastUses(int ac, char *av[], int **lastp) {
+  int *last = NULL;
+  int n = 0;
+  int cap = 0;
+  for (int k = 1; k < ac; k++) {
+    const char *op = av[k];
+    int start = k;
+    const struct opInfo *info = findOp(op);
+    int operands = 0; // mandatory
+    int uses = 0;     // images before the end of the buffer
+    int creates = 1;  // an image file, unless an operation
+    if (info != NULL) {
+      operands = info->operands;
+      uses = info->uses;
+      creates = info->creates;
+    }
+    // Skip the optional operands (those of thr adaptive are the word
+    // adaptive and the method), and find what depends on the operands.
+    if (strcmp(op, "thr") == 0) {
+      if (k + 1 < ac && strcmp(av[k + 1], "adaptive") == 0) {
+        k++;
+        if (k + 2 < ac && (strcmp(av[k + 2], "bradley") == 0 ||
+                           strcmp(av[k + 2], "sauvola") == 0))
+          k++;
+      }
+    } else if (strcmp(op, "conv") == 0) {
+      if (k + 2 < ac && (strcmp(av[k + 2], "replicate") == 0 ||
+                         strcmp(av[k + 2], "shrink") == 0))
+        k++;
+    } else if (strcmp(op, "locate") == 0) {
+      int tol;
+      char c;
+      if (k + 1 < ac && sscanf(av[k + 1], "%d%c", &tol, &c) == 1) {
+        if (tol < 0 || tol > 255)
+          break;
+        k++;
+      }
+    } else if (strcmp(op, "mlocate") == 0) {
+      if (k + 1 >= ac || sscanf(av[k + 1], "%d", &uses) != 1 || uses < 1)
+        break;
+      uses++;
+    } else if (strcmp(op, "mblur") == 0) {
+      for (const char *p = k + 1 < ac ? av[k + 1] : ""; *p != '\0'; p++)
+        creates += *p == ',';
+    }
+    if (k + operands >= ac || uses > n)
+      break;
+    k += operands;
+    for (int i = n - uses; i < n; i++)
+      last[i] = start;
+    if (n + creates > cap) {
+      cap = 2 * (n + creates);
+      int *grown = realloc(last, cap * sizeof(int));
+      if (grown == NULL)
+        break;
+      last = grown;
+    }
+    for (int i = n; i < n + creates; i++)
+      last[i] = start;
+    n += creates;
+    if (k == ac - 1) {
+      *lastp = last;
+      return n;
+    }
+  }
+  free(last);
+  *lastp = NULL;
+  return -1;
+}
+
+// Release the images whose last use is operation op or earlier (unless a
+// pending image needs them), and drop them if pending.
+static void release(Image img[], struct pending pend[], int n,
+                    const int last[], int op) {
+  // Pending images come after their sources.
+  for (int i = n - 1; i >= 0; i--) {
+    if (last[i] > op || (img[i] == NULL && pend[i].src < 0))
+      continue;
+    int needed = 0;
+    for (int j = i + 1; j < n; j++)
+      needed |= pend[j].src == i;
+    if (!needed) {
+      fprintf(stderr, "Releasing I%d\n", i);
+      pend[i].src = -1;
+      ImageDestroy(&img[i]);
+    }
+  }
+}
+
+// Grow the buffer of images (and pending images) to hold at least m.
+// Returns 0 on failure.
+static int reserve(Image **img, struct pending **pend, int *cap, int m) {
+  if (m <= *cap)
+    return 1;
+  int grown = *cap > 0 ? 2 * *cap : 10;
+  if (grown < m)
+    grown = m;
+  Image *i = realloc(*img, grown * sizeof(Image));
+  if (i != NULL)
+    *img = i;
+  struct pending *p = realloc(*pend, grown * sizeof(struct pending));
+  if (p != NULL)
+    *pend = p;
+  if (i == NULL || p == NULL)
+    return 0;
+  for (int k = *cap; k < grown; k++)
+    p[k].src = -1;
+  *cap = grown;
+  return 1;
+}
+
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
 // precondition checks, so that you can force precondition violations, and
@@ -98,36 +546,129 @@ int main(int ac, char *av[]) {
   int x, y, w, h;
 
   // The image buffer
-  const int N = 10; // buffer capacity
-  Image img[N];     // the images
-  int n = 0;        // number of images created
+  Image *img = NULL; // the images (NULL once released, or while pending)
+  int cap = 0;       // buffer capacity
+  int n = 0;         // number of images created
+
+  // Pending images (see materialize), unless eager
+  struct pending *pend = NULL;
+  int eager = 0;
+
+  // Images are released after their last use, if known
+  int *last = NULL;
+  int total = lastUses(ac, av, &last);
+  if (!reserve(&img, &pend, &cap, total > 0 ? total : 1))
+    error(3, errno, "%s", errors[3]);
+
+  // The block-hash index, and the image it was built for
+  ImageIndex index = NULL;
+  int indexed = -1;
 
   int k = 1;
   while (k < ac) {
-    if (strcmp(av[k], "info") == 0) {
+    int op = k;
+    // Other operations need every image to be computed.
+    if (!deferrable(av[k])) {
+      for (int i = 0; i < n && err == 0; i++) {
+        if (!materialize(img, pend, i))
+          err = 4;
+      }
+      if (err != 0)
+        break;
+    }
+    if (findOp(av[k]) == NULL) { // image file
+      if (!reserve(&img, &pend, &cap, n + 1)) {
+        err = 3;
+        break;
+      }
+      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
+      img[n] = ImageLoad(av[k]);
+      if (img[n] == NULL) {
+        err = 4;
+        break;
+      }
+      n++;
+    } else if (strcmp(av[k], "eager") == 0) {
+      fprintf(stderr, "Eager execution\n");
+      eager = 1;
+    } else if (strcmp(av[k], "info") == 0) {
       if (n < 1) {
         err = 2;
         break;
       }
       fprintf(stderr, "Info on I%d\n", n - 1);
-      uint8 min, max;
       w = ImageWidth(img[n - 1]);
       h = ImageHeight(img[n - 1]);
       uint8 maxval = ImageMaxval(img[n - 1]);
-      ImageStats(img[n - 1], &min, &max);
+      // A single pass over the pixels: everything from the histogram.
+      uint32_t hist[256];
+      ImageHistogram(img[n - 1], hist);
+      int min = 0;
+      int max = 255;
+      while (min < 255 && hist[min] == 0)
+        min++;
+      while (max > 0 && hist[max] == 0)
+        max--;
+      if (min > max) // no pixels
+        min = max = 0;
+      double mean, stddev;
+      ImageHistogramMoments(hist, &mean, &stddev);
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      printf("# Gray level range: [%d, %d]\n", min, max);
+      printf("# Mean: %.3f\n# Stddev: %.3f\n", mean, stddev);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
       InstrPrint();
+    } else if (strcmp(av[k], "pool") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      double mb;
+      if (sscanf(av[k], "%lf", &mb) != 1 || mb < 0) {
+        err = 5;
+        break;
+      }
+      fprintf(stderr, "Pooling up to %g MB\n", mb);
+      ImagePoolSetLimit((size_t)(mb * 1024 * 1024));
+    } else if (strcmp(av[k], "huge") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      AllocPolicy policy;
+      if (strcmp(av[k], "thp") == 0) {
+        policy = ALLOC_THP;
+      } else if (strcmp(av[k], "explicit") == 0) {
+        policy = ALLOC_HUGETLB;
+      } else if (strcmp(av[k], "off") == 0) {
+        policy = ALLOC_MALLOC;
+      } else {
+        err = 5;
+        break;
+      }
+      fprintf(stderr, "Huge pages: %s\n", av[k]);
+      ImageSetAllocPolicy(policy);
+    } else if (strcmp(av[k], "mem") == 0) {
+      uint64_t requests, hits;
+      size_t footprint, peak;
+      ImagePoolStats(&requests, &hits, &footprint, &peak);
+      printf("# Pool hits: %" PRIu64 "/%" PRIu64 " (%.1f%%)\n", hits,
+             requests, requests > 0 ? 100.0 * hits / requests : 0.0);
+      printf("# Pixel memory: %zu KB (peak %zu KB)\n", footprint / 1024,
+             peak / 1024);
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) {
         err = 2;
         break;
       }
       fprintf(stderr, "Negating I%d\n", n - 1);
-      ImageNegative(img[n - 1]);
+      struct stage s = {.kind = NEG};
+      if (!defer(img, pend, n - 1, eager, &s)) {
+        err = 4;
+        break;
+      }
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) {
         err = 1;
@@ -137,13 +678,48 @@ int main(int ac, char *av[]) {
         err = 2;
         break;
       }
-      uint8 thr;
-      if (sscanf(av[k], "%hhu", &thr) != 1) {
-        err = 5;
+      struct stage s = {.kind = THR};
+      if (strcmp(av[k], "adaptive") == 0) {
+        if (++k >= ac) {
+          err = 1;
+          break;
+        }
+        int dx;
+        int dy;
+        double factor;
+        if (sscanf(av[k], "%d,%d,%lf", &dx, &dy, &factor) != 3 || dx < 0 ||
+            dy < 0) {
+          err = 5;
+          break;
+        }
+        // optional operand: method
+        ThresholdMethod method = THR_SAUVOLA;
+        if (k + 1 < ac && strcmp(av[k + 1], "bradley") == 0) {
+          method = THR_BRADLEY;
+          k++;
+        } else if (k + 1 < ac && strcmp(av[k + 1], "sauvola") == 0) {
+          k++;
+        }
+        fprintf(stderr, "Adaptive thresholding I%d with %dx%d window\n",
+                n - 1, 2 * dx + 1, 2 * dy + 1);
+        s = (struct stage){.kind = ADAPTIVE,
+                           .dx = dx,
+                           .dy = dy,
+                           .factor = factor,
+                           .method = method};
+      } else {
+        uint8 thr;
+        if (sscanf(av[k], "%hhu", &thr) != 1) {
+          err = 5;
+          break;
+        }
+        fprintf(stderr, "Thresholding I%d at %d\n", n - 1, thr);
+        s.dx = thr;
+      }
+      if (!defer(img, pend, n - 1, eager, &s)) {
+        err = 4;
         break;
       }
-      fprintf(stderr, "Thresholding I%d at %d\n", n - 1, thr);
-      ImageThreshold(img[n - 1], (uint8)thr);
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) {
         err = 1;
@@ -159,13 +735,17 @@ int main(int ac, char *av[]) {
         break;
       }
       fprintf(stderr, "Brightening I%d by %lf\n", n - 1, factor);
-      ImageBrighten(img[n - 1], factor);
+      struct stage s = {.kind = BRI, .factor = factor};
+      if (!defer(img, pend, n - 1, eager, &s)) {
+        err = 4;
+        break;
+      }
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) {
         err = 1;
         break;
       }
-      if (n >= N) {
+      if (!reserve(&img, &pend, &cap, n + 1)) {
         err = 3;
         break;
       }
@@ -189,7 +769,7 @@ int main(int ac, char *av[]) {
         err = 2;
         break;
       }
-      if (n >= N) {
+      if (!reserve(&img, &pend, &cap, n + 1)) {
         err = 3;
         break;
       }
@@ -200,12 +780,28 @@ int main(int ac, char *av[]) {
         break;
       }
       n++;
+    } else if (strcmp(av[k], "clone") == 0) {
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      if (!reserve(&img, &pend, &cap, n + 1)) {
+        err = 3;
+        break;
+      }
+      fprintf(stderr, "Cloning I%d -> I%d\n", n - 1, n);
+      img[n] = ImageClone(img[n - 1]);
+      if (img[n] == NULL) {
+        err = 4;
+        break;
+      }
+      n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) {
         err = 2;
         break;
       }
-      if (n >= N) {
+      if (!reserve(&img, &pend, &cap, n + 1)) {
         err = 3;
         break;
       }
@@ -225,7 +821,7 @@ int main(int ac, char *av[]) {
         err = 2;
         break;
       }
-      if (n >= N) {
+      if (!reserve(&img, &pend, &cap, n + 1)) {
         err = 3;
         break;
       }
@@ -233,16 +829,27 @@ int main(int ac, char *av[]) {
         err = 5;
         break;
       }
+      // A pending crop is of a computed image.
+      if (!materialize(img, pend, n - 1)) {
+        err = 4;
+        break;
+      }
       if (!ImageValidRect(img[n - 1], x, y, w, h)) {
         err = 5;
         break;
       } // precondition check!
       fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n - 1, x, y, w, h,
               n);
-      img[n] = ImageCrop(img[n - 1], x, y, w, h);
-      if (img[n] == NULL) {
-        err = 4;
-        break;
+      if (eager) {
+        img[n] = ImageCrop(img[n - 1], x, y, w, h);
+        if (img[n] == NULL) {
+          err = 4;
+          break;
+        }
+      } else {
+        img[n] = NULL;
+        pend[n] =
+            (struct pending){.src = n - 1, .x = x, .y = y, .w = w, .h = h};
       }
       n++;
     } else if (strcmp(av[k], "paste") == 0) {
@@ -265,7 +872,10 @@ int main(int ac, char *av[]) {
         break;
       }
       fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n - 2, n - 1, x, y);
-      ImagePaste(img[n - 1], x, y, img[n - 2]);
+      if (!ImagePaste(img[n - 1], x, y, img[n - 2])) {
+        err = 4;
+        break;
+      }
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) {
         err = 1;
@@ -288,14 +898,218 @@ int main(int ac, char *av[]) {
       }
       fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n - 2,
               n - 1, x, y, alpha);
-      ImageBlend(img[n - 1], x, y, img[n - 2], alpha);
+      if (!ImageBlend(img[n - 1], x, y, img[n - 2], alpha)) {
+        err = 4;
+        break;
+      }
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) {
         err = 2;
         break;
       }
-      fprintf(stderr, "Locating I%d in I%d\n", n - 2, n - 1);
-      if (ImageLocateSubImage(img[n - 1], &x, &y, img[n - 2])) {
+      w = ImageWidth(img[n - 2]);
+      h = ImageHeight(img[n - 2]);
+      if (!ImageValidRect(img[n - 1], 0, 0, w, h)) {
+        err = 5;
+        break;
+      } // precondition check!
+      // optional operand: tolerance
+      int tol;
+      char c;
+      int found;
+      if (k + 1 < ac && sscanf(av[k + 1], "%d%c", &tol, &c) == 1) {
+        if (tol < 0 || tol > 255) {
+          err = 5;
+          break;
+        }
+        k++;
+        fprintf(stderr, "Locating I%d in I%d (tolerance %d)\n", n - 2, n - 1,
+                tol);
+        found = ImageLocateSubImageTol(img[n - 1], &x, &y, img[n - 2], tol);
+      } else {
+        fprintf(stderr, "Locating I%d in I%d\n", n - 2, n - 1);
+        found = ImageLocateSubImage(img[n - 1], &x, &y, img[n - 2]);
+      }
+      if (found) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "mlocate") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      int m;
+      if (sscanf(av[k], "%d", &m) != 1 || m < 1) {
+        err = 5;
+        break;
+      }
+      if (n < m + 1) {
+        err = 2;
+        break;
+      }
+      w = ImageWidth(img[n - 2]);
+      h = ImageHeight(img[n - 2]);
+      int i;
+      for (i = n - m - 1; i < n - 1; i++) {
+        if (ImageWidth(img[i]) != w || ImageHeight(img[i]) != h)
+          break;
+      }
+      if (i < n - 1 || !ImageValidRect(img[n - 1], 0, 0, w, h)) {
+        err = 5;
+        break;
+      } // precondition check!
+      fprintf(stderr, "Locating I%d..I%d in I%d\n", n - m - 1, n - 2, n - 1);
+      int *px = malloc(2 * m * sizeof(int));
+      int *py = px + m;
+      if (px == NULL ||
+          ImageLocateSubImages(img[n - 1], m, &img[n - m - 1], px, py) < 0) {
+        free(px);
+        err = 4;
+        break;
+      }
+      for (i = 0; i < m; i++) {
+        if (px[i] >= 0) {
+          printf("# I%d FOUND (%d,%d)\n", n - m - 1 + i, px[i], py[i]);
+        } else {
+          printf("# I%d NOTFOUND\n", n - m - 1 + i);
+        }
+      }
+      free(px);
+    } else if (strcmp(av[k], "olocate") == 0) {
+      if (n < 2) {
+        err = 2;
+        break;
+      }
+      fprintf(stderr, "Locating I%d in I%d (any orientation)\n", n - 2, n - 1);
+      int o;
+      int found = ImageLocateSubImageOriented(img[n - 1], &x, &y, &o,
+                                              img[n - 2]);
+      if (found < 0) {
+        err = 4;
+        break;
+      }
+      if (found) {
+        printf("# FOUND (%d,%d) orientation %d\n", x, y, o);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "match") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      if (n < 2) {
+        err = 2;
+        break;
+      }
+      MatchMetric metric;
+      if (strcmp(av[k], "sad") == 0) {
+        metric = MATCH_SAD;
+      } else if (strcmp(av[k], "ssd") == 0) {
+        metric = MATCH_SSD;
+      } else if (strcmp(av[k], "ncc") == 0) {
+        metric = MATCH_NCC;
+      } else {
+        err = 5;
+        break;
+      }
+      w = ImageWidth(img[n - 2]);
+      h = ImageHeight(img[n - 2]);
+      if (!ImageValidRect(img[n - 1], 0, 0, w, h)) {
+        err = 5;
+        break;
+      } // precondition check!
+      fprintf(stderr, "Matching I%d in I%d (%s)\n", n - 2, n - 1, av[k]);
+      double score;
+      if (!ImageLocateBestMatch(img[n - 1], &x, &y, img[n - 2], metric,
+                                &score)) {
+        err = 4;
+        break;
+      }
+      printf("# BEST (%d,%d) score %g\n", x, y, score);
+    } else if (strcmp(av[k], "plocate") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      if (n < 2) {
+        err = 2;
+        break;
+      }
+      int tol;
+      if (sscanf(av[k], "%d", &tol) != 1 || tol < 0 || tol > 255) {
+        err = 5;
+        break;
+      }
+      w = ImageWidth(img[n - 2]);
+      h = ImageHeight(img[n - 2]);
+      if (!ImageValidRect(img[n - 1], 0, 0, w, h)) {
+        err = 5;
+        break;
+      } // precondition check!
+      fprintf(stderr, "Locating I%d in I%d (pyramid, tolerance %d)\n", n - 2,
+              n - 1, tol);
+      ImagePyramid pyr = ImagePyramidCreate(img[n - 1], 0);
+      if (pyr == NULL) {
+        err = 4;
+        break;
+      }
+      int found = ImagePyramidLocate(pyr, &x, &y, img[n - 2], tol, 0);
+      ImagePyramidDestroy(&pyr);
+      if (found < 0) {
+        err = 4;
+        break;
+      }
+      if (found) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "index") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      ImageIndexDestroy(&index);
+      indexed = n - 1;
+      index = ImageIndexLoad(av[k], img[n - 1]);
+      if (index != NULL) {
+        fprintf(stderr, "Loaded index of I%d from %s\n", n - 1, av[k]);
+      } else {
+        errno = 0; // failing to load is not an error
+        w = ImageWidth(img[n - 1]);
+        h = ImageHeight(img[n - 1]);
+        fprintf(stderr, "Indexing I%d -> %s\n", n - 1, av[k]);
+        index = ImageIndexCreate(img[n - 1], w < 8 ? w : 8, h < 8 ? h : 8);
+        if (index == NULL || ImageIndexSave(index, av[k]) == 0) {
+          err = 4;
+          break;
+        }
+      }
+    } else if (strcmp(av[k], "ilocate") == 0) {
+      if (n < 2) {
+        err = 2;
+        break;
+      }
+      if (index == NULL || indexed != n - 1) {
+        err = 8;
+        break;
+      }
+      w = ImageWidth(img[n - 2]);
+      h = ImageHeight(img[n - 2]);
+      if (!ImageValidRect(img[n - 1], 0, 0, w, h) ||
+          w < ImageIndexBlockWidth(index) || h < ImageIndexBlockHeight(index)) {
+        err = 5;
+        break;
+      } // precondition check!
+      fprintf(stderr, "Locating I%d in I%d (indexed)\n", n - 2, n - 1);
+      if (ImageIndexLocate(index, &x, &y, img[n - 2])) {
         printf("# FOUND (%d,%d)\n", x, y);
       } else {
         printf("# NOTFOUND\n");
@@ -317,8 +1131,12 @@ int main(int ac, char *av[]) {
       }
       fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n - 1, 2 * dx + 1,
               2 * dy + 1);
-      ImageBlur(img[n - 1], dx, dy);
-    } else if (strcmp(av[k], "save") == 0) {
+      struct stage s = {.kind = BLUR, .dx = dx, .dy = dy};
+      if (!defer(img, pend, n - 1, eager, &s)) {
+        err = 4;
+        break;
+      }
+    } else if (strcmp(av[k], "gauss") == 0) {
       if (++k >= ac) {
         err = 1;
         break;
@@ -327,31 +1145,306 @@ int main(int ac, char *av[]) {
         err = 2;
         break;
       }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n - 1);
-      if (ImageSave(img[n - 1], av[k]) == 0) {
+      double sigma;
+      if (sscanf(av[k], "%lf", &sigma) != 1 || !(sigma >= 0.0)) {
+        err = 5;
+        break;
+      }
+      fprintf(stderr, "Gaussian blur I%d with sigma %lf\n", n - 1, sigma);
+      if (!ImageGaussianBlur(img[n - 1], sigma)) {
+        err = 4;
+        break;
+      }
+    } else if (strcmp(av[k], "median") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      int dx;
+      int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) {
+        err = 5;
+        break;
+      }
+      fprintf(stderr, "Median filter I%d with %dx%d window\n", n - 1,
+              2 * dx + 1, 2 * dy + 1);
+      struct stage s = {.kind = MEDIAN, .dx = dx, .dy = dy};
+      if (!defer(img, pend, n - 1, eager, &s)) {
+        err = 4;
+        break;
+      }
+    } else if (strcmp(av[k], "mblur") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      // operand: comma-separated list of radii
+      int radii = 1;
+      for (const char *p = av[k]; *p != '\0'; p++)
+        radii += *p == ',';
+      int *r = malloc(radii * sizeof(int));
+      if (r == NULL) {
         err = 4;
         break;
       }
-    } else { // image file
-      if (n >= N) {
+      int m = 0;
+      const char *p = av[k];
+      int len;
+      while (m < radii && sscanf(p, "%d%n", &r[m], &len) == 1 && r[m] >= 0) {
+        m++;
+        p += len;
+        if (*p != ',')
+          break;
+        p++;
+      }
+      if (m == 0 || *p != '\0') {
+        free(r);
+        err = 5;
+        break;
+      }
+      if (!reserve(&img, &pend, &cap, n + m)) {
+        free(r);
         err = 3;
         break;
       }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) {
+      fprintf(stderr, "Blur I%d with %d mean filters -> I%d..I%d\n", n - 1,
+              m, n, n + m - 1);
+      int ok = ImageBlurMulti(img[n - 1], m, r, r, img + n);
+      free(r);
+      if (!ok) {
         err = 4;
         break;
       }
-      n++;
+      n += m;
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      const char *op = av[k];
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      int dx;
+      int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) {
+        err = 5;
+        break;
+      }
+      fprintf(stderr, "Morphological %s of I%d with %dx%d rectangle\n", op,
+              n - 1, 2 * dx + 1, 2 * dy + 1);
+      struct stage s = {.kind = op[0] == 'e'   ? ERODE
+                                : op[0] == 'd' ? DILATE
+                                : op[0] == 'o' ? OPEN
+                                               : CLOSE,
+                        .dx = dx,
+                        .dy = dy};
+      if (!defer(img, pend, n - 1, eager, &s)) {
+        err = 4;
+        break;
+      }
+    } else if (strcmp(av[k], "conv") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      // operand: preset name, or W,H,DIV:C,C,... (W*H coefficients)
+      int kw = 0;
+      int kh = 0;
+      int div = 0;
+      int coef[81];
+      const char *p = av[k];
+      int len;
+      for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (strcmp(p, kernels[i].name) == 0) {
+          kw = kernels[i].w;
+          kh = kernels[i].h;
+          div = kernels[i].div;
+          memcpy(coef, kernels[i].coef, sizeof(kernels[i].coef));
+        }
+      }
+      if (kw == 0 && sscanf(p, "%d,%d,%d:%n", &kw, &kh, &div, &len) == 3 &&
+          kw > 0 && kh > 0 && kw % 2 == 1 && kh % 2 == 1 && kw * kh <= 81) {
+        p += len;
+        int m = 0;
+        while (m < kw * kh && sscanf(p, "%d%n", &coef[m], &len) == 1 &&
+               coef[m] >= -32767 && coef[m] <= 32767) {
+          m++;
+          p += len;
+          if (*p != ',')
+            break;
+          p++;
+        }
+        if (m != kw * kh || *p != '\0')
+          kw = 0;
+      }
+      long total = 0;
+      for (int i = 0; i < kw * kh; i++)
+        total += coef[i] < 0 ? -coef[i] : coef[i];
+      if (kw <= 0 || kh <= 0 || div <= 0 || total > INT32_MAX / 255) {
+        err = 5;
+        break;
+      }
+      // optional operand: edge mode
+      ConvEdge edge = CONV_SHRINK;
+      if (k + 1 < ac && strcmp(av[k + 1], "replicate") == 0) {
+        edge = CONV_REPLICATE;
+        k++;
+      } else if (k + 1 < ac && strcmp(av[k + 1], "shrink") == 0) {
+        k++;
+      }
+      fprintf(stderr, "Convolve I%d with %dx%d kernel\n", n - 1, kw, kh);
+      ConvKernel kernel = ConvKernelCreate(kw, kh, coef, div);
+      if (kernel == NULL) {
+        err = 4;
+        break;
+      }
+      int ok = ImageConvolve(img[n - 1], kernel, edge);
+      ConvKernelDestroy(&kernel);
+      if (!ok) {
+        err = 4;
+        break;
+      }
+    } else if (strcmp(av[k], "sobel") == 0) {
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      fprintf(stderr, "Sobel gradient magnitude of I%d\n", n - 1);
+      if (!ImageSobel(img[n - 1], NULL)) {
+        err = 4;
+        break;
+      }
+    } else if (strcmp(av[k], "canny") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      double sigma;
+      int low;
+      int high;
+      if (sscanf(av[k], "%lf,%d,%d", &sigma, &low, &high) != 3 ||
+          !(sigma >= 0.0) || low < 0 || high < low) {
+        err = 5;
+        break;
+      }
+      fprintf(stderr, "Canny edges of I%d (sigma %lf, thresholds %d, %d)\n",
+              n - 1, sigma, low, high);
+      if (!ImageCanny(img[n - 1], sigma, low, high)) {
+        err = 4;
+        break;
+      }
+    } else if (strcmp(av[k], "eq") == 0) {
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      fprintf(stderr, "Equalizing I%d\n", n - 1);
+      if (!ImageEqualize(img[n - 1])) {
+        err = 4;
+        break;
+      }
+    } else if (strcmp(av[k], "clahe") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      int tx;
+      int ty;
+      double clip;
+      if (sscanf(av[k], "%d,%d,%lf", &tx, &ty, &clip) != 3 || tx < 1 ||
+          ty < 1 || tx > ImageWidth(img[n - 1]) ||
+          ty > ImageHeight(img[n - 1]) || !(clip >= 1.0)) {
+        err = 5;
+        break;
+      }
+      fprintf(stderr, "CLAHE on I%d with %dx%d tiles, clip %lf\n", n - 1, tx,
+              ty, clip);
+      if (!ImageCLAHE(img[n - 1], tx, ty, clip)) {
+        err = 4;
+        break;
+      }
+    } else if (strcmp(av[k], "norm") == 0) {
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      fprintf(stderr, "Normalizing I%d\n", n - 1);
+      if (!ImageNormalize(img[n - 1])) {
+        err = 4;
+        break;
+      }
+    } else if (strcmp(av[k], "normfile") == 0) {
+      if (k + 2 >= ac) {
+        err = 1;
+        break;
+      }
+      fprintf(stderr, "Normalizing %s -> %s\n", av[k + 1], av[k + 2]);
+      if (!ImageNormalizeFile(av[k + 1], av[k + 2])) {
+        err = 4;
+        break;
+      }
+      k += 2;
+    } else if (strcmp(av[k], "save") == 0) {
+      if (++k >= ac) {
+        err = 1;
+        break;
+      }
+      if (n < 1) {
+        err = 2;
+        break;
+      }
+      fprintf(stderr, "Saving %s <- I%d\n", av[k], n - 1);
+      if (ImageSave(img[n - 1], av[k]) == 0) {
+        err = 4;
+        break;
+      }
+    }
+    // An index is only valid for the pixels it was built from.
+    if (indexed == n - 1 && mutates(av[op])) {
+      ImageIndexDestroy(&index);
+      indexed = -1;
+    }
+    if (last != NULL) {
+      release(img, pend, n, last, op);
+      if (indexed >= 0 && img[indexed] == NULL) {
+        ImageIndexDestroy(&index);
+        indexed = -1;
+      }
     }
     k++;
   }
 
-  // Destroy remaining images
+  // Destroy index and remaining images
+  ImageIndexDestroy(&index);
   while (n > 0) {
     ImageDestroy(&img[--n]);
   }
+  free(img);
+  free(pend);
+  free(last);
 
   error(err, errno, errors[err], ImageErrMsg());
   return 0;